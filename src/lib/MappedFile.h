@@ -0,0 +1,47 @@
+#pragma once
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <filesystem>
+#include <format>
+#include <stdexcept>
+#include <string_view>
+
+// Read-only memory mapping of a whole file, advised for one sequential pass.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::filesystem::path& path)
+    {
+        namespace bip = boost::interprocess;
+        if (std::filesystem::file_size(path) == 0)
+            return; // empty files cannot be mapped
+        try
+        {
+            mapping = bip::file_mapping(path.string().c_str(), bip::read_only);
+            region = bip::mapped_region(mapping, bip::read_only);
+        }
+        catch (const bip::interprocess_exception& e)
+        {
+            throw std::runtime_error(std::format("Cannot map {}: {}", path.string(), e.what()));
+        }
+        region.advise(bip::mapped_region::advice_sequential);
+    }
+
+    [[nodiscard]] std::string_view view() const noexcept
+    {
+        return {static_cast<const char*>(region.get_address()), region.get_size()};
+    }
+
+    // Bytes readable from the start of view(): the mapping covers whole pages, and the part of the
+    // last page past the end of the file reads as zeros.
+    [[nodiscard]] size_t readable() const noexcept
+    {
+        const size_t page = boost::interprocess::mapped_region::get_page_size();
+        return (region.get_size() + page - 1) / page * page;
+    }
+
+private:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+};
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+#include "StripedSharedMutex.h"
+
+// Log-linear histogram (4 sub-buckets per power of two, ~25% relative error) over non-negative
+// integers, recorded with relaxed atomics so concurrent writers never block each other.
+class LogHistogram
+{
+public:
+    static constexpr size_t subBuckets = 4;
+    static constexpr size_t maxExponent = 40;
+    static constexpr size_t bucketCount = subBuckets + (maxExponent - 1) * subBuckets;
+
+    struct Snapshot
+    {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> buckets; // (upper bound, count), non-empty buckets only
+    };
+
+    void record(uint64_t v) noexcept
+    {
+        counts[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        auto cur = max.load(std::memory_order_relaxed);
+        while (v > cur && !max.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    [[nodiscard]] Snapshot snapshot() const
+    {
+        return merged(std::span<const LogHistogram>(this, 1), std::identity{});
+    }
+
+    // One snapshot over several histograms of the same measurement, e.g. per-thread shards;
+    // proj maps each element of `range` to its histogram.
+    template <class Range, class Proj>
+    [[nodiscard]] static Snapshot merged(const Range& range, Proj proj)
+    {
+        Snapshot out;
+        std::array<uint64_t, bucketCount> copy{};
+        for (const auto& element : range)
+        {
+            const LogHistogram& hist = std::invoke(proj, element);
+            for (size_t i = 0; i < bucketCount; ++i)
+                copy[i] += hist.counts[i].load(std::memory_order_relaxed);
+            out.sum += hist.sum.load(std::memory_order_relaxed);
+            out.max = std::max(out.max, hist.max.load(std::memory_order_relaxed));
+        }
+        for (size_t i = 0; i < bucketCount; ++i)
+        {
+            out.count += copy[i];
+            if (copy[i])
+                out.buckets.emplace_back(upper_bound_of(i), copy[i]);
+        }
+        out.p50 = percentile(copy, out.count, 0.50);
+        out.p90 = percentile(copy, out.count, 0.90);
+        out.p99 = percentile(copy, out.count, 0.99);
+        return out;
+    }
+
+    void reset() noexcept
+    {
+        for (auto& c : counts)
+            c.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+    static constexpr size_t bucket_of(uint64_t v) noexcept
+    {
+        if (v < subBuckets)
+            return v;
+        const size_t e = std::bit_width(v) - 1; // >= 2
+        if (e >= maxExponent)
+            return bucketCount - 1;
+        const size_t sub = (v >> (e - 2)) & (subBuckets - 1);
+        return subBuckets + (e - 2) * subBuckets + sub;
+    }
+
+    static constexpr uint64_t upper_bound_of(size_t idx) noexcept
+    {
+        if (idx < subBuckets)
+            return idx;
+        const size_t e = (idx - subBuckets) / subBuckets + 2;
+        const size_t sub = (idx - subBuckets) % subBuckets;
+        return ((subBuckets + sub) << (e - 2)) + (uint64_t{1} << (e - 2)) - 1;
+    }
+
+private:
+    static uint64_t percentile(const std::array<uint64_t, bucketCount>& copy, uint64_t count, double q) noexcept
+    {
+        if (count == 0)
+            return 0;
+        const auto rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; ++i)
+        {
+            seen += copy[i];
+            if (seen >= rank)
+                return upper_bound_of(i);
+        }
+        return upper_bound_of(bucketCount - 1);
+    }
+
+    std::array<std::atomic<uint64_t>, bucketCount> counts{};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+struct MetricsSnapshot
+{
+    bool enabled = false;
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, LogHistogram::Snapshot> histograms; // latencies in nanoseconds unless named *_size
+};
+
+// Hot-path counters of a SmallCache. Only compiled in with SMALL_CACHE_HAS_METRICS.
+struct CacheMetrics
+{
+    // Read-path counters, sharded by StripedSharedMutex::this_thread_stripe() so that readers on
+    // different cores do not write the same cache lines; snapshot() sums the shards.
+    struct alignas(64) ReadShard
+    {
+        std::atomic<uint64_t> get_one_hits{0};
+        std::atomic<uint64_t> get_one_misses{0};
+        LogHistogram get_one_ns;
+        LogHistogram get_many_ns;
+        LogHistogram get_many_batch_size;
+    };
+
+    std::array<ReadShard, StripedSharedMutex::stripeCount> readShards;
+
+    ReadShard& read_shard() noexcept { return readShards[StripedSharedMutex::this_thread_stripe()]; }
+
+    std::atomic<uint64_t> items_added{0};
+    std::atomic<uint64_t> items_patched{0};
+    std::atomic<uint64_t> pages_loaded{0};
+    std::atomic<uint64_t> transactions{0};
+
+    LogHistogram add_item_ns;
+    LogHistogram add_many_ns;
+    LogHistogram patch_item_ns;
+    LogHistogram load_page_parse_ns;
+    LogHistogram load_page_insert_ns;
+    LogHistogram end_transaction_ns;
+    LogHistogram scan_ns;
+    LogHistogram ordered_scan_ns;
+    LogHistogram aggregate_ns;
+    LogHistogram apply_log_ns;
+
+    [[nodiscard]] MetricsSnapshot snapshot() const
+    {
+        MetricsSnapshot out;
+        out.enabled = true;
+        const auto sharded = [&](const std::atomic<uint64_t> ReadShard::* counter)
+        {
+            uint64_t total = 0;
+            for (const auto& shard : readShards)
+                total += (shard.*counter).load(std::memory_order_relaxed);
+            return total;
+        };
+        out.counters = {
+            {"get_one_hits", sharded(&ReadShard::get_one_hits)},
+            {"get_one_misses", sharded(&ReadShard::get_one_misses)},
+            {"items_added", items_added.load(std::memory_order_relaxed)},
+            {"items_patched", items_patched.load(std::memory_order_relaxed)},
+            {"pages_loaded", pages_loaded.load(std::memory_order_relaxed)},
+            {"transactions", transactions.load(std::memory_order_relaxed)},
+        };
+        out.histograms = {
+            {"get_one_ns", LogHistogram::merged(readShards, &ReadShard::get_one_ns)},
+            {"get_many_ns", LogHistogram::merged(readShards, &ReadShard::get_many_ns)},
+            {"get_many_batch_size", LogHistogram::merged(readShards, &ReadShard::get_many_batch_size)},
+            {"add_item_ns", add_item_ns.snapshot()},
+            {"add_many_ns", add_many_ns.snapshot()},
+            {"patch_item_ns", patch_item_ns.snapshot()},
+            {"load_page_parse_ns", load_page_parse_ns.snapshot()},
+            {"load_page_insert_ns", load_page_insert_ns.snapshot()},
+            {"end_transaction_ns", end_transaction_ns.snapshot()},
+            {"scan_ns", scan_ns.snapshot()},
+            {"ordered_scan_ns", ordered_scan_ns.snapshot()},
+            {"aggregate_ns", aggregate_ns.snapshot()},
+            {"apply_log_ns", apply_log_ns.snapshot()},
+        };
+        return out;
+    }
+
+    void reset() noexcept
+    {
+        for (auto& shard : readShards)
+        {
+            shard.get_one_hits.store(0, std::memory_order_relaxed);
+            shard.get_one_misses.store(0, std::memory_order_relaxed);
+            for (auto* h : {&shard.get_one_ns, &shard.get_many_ns, &shard.get_many_batch_size})
+                h->reset();
+        }
+        for (auto* c : {&items_added, &items_patched, &pages_loaded, &transactions})
+            c->store(0, std::memory_order_relaxed);
+        for (auto* h : {&add_item_ns, &add_many_ns,
+                        &patch_item_ns, &load_page_parse_ns, &load_page_insert_ns, &end_transaction_ns, &scan_ns,
+                        &ordered_scan_ns, &aggregate_ns, &apply_log_ns})
+            h->reset();
+    }
+};
+
+// Records the lifetime of the scope into a histogram.
+class ScopedLatency
+{
+public:
+    explicit ScopedLatency(LogHistogram& hist) noexcept : hist(hist), start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ScopedLatency()
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        hist.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+private:
+    LogHistogram& hist;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef SMALL_CACHE_HAS_METRICS
+#define SMALL_CACHE_COUNT(counter, n) cacheMetrics.counter.fetch_add((n), std::memory_order_relaxed)
+#define SMALL_CACHE_RECORD(hist, v) cacheMetrics.hist.record(v)
+#define SMALL_CACHE_TIME_SCOPE(hist) const ScopedLatency scoped_latency_##hist{cacheMetrics.hist}
+// the same for the counters in CacheMetrics::ReadShard
+#define SMALL_CACHE_READ_COUNT(counter, n) cacheMetrics.read_shard().counter.fetch_add((n), std::memory_order_relaxed)
+#define SMALL_CACHE_READ_RECORD(hist, v) cacheMetrics.read_shard().hist.record(v)
+#define SMALL_CACHE_READ_TIME_SCOPE(hist) const ScopedLatency scoped_latency_##hist{cacheMetrics.read_shard().hist}
+#else
+#define SMALL_CACHE_COUNT(counter, n) ((void)0)
+#define SMALL_CACHE_RECORD(hist, v) ((void)0)
+#define SMALL_CACHE_TIME_SCOPE(hist) ((void)0)
+#define SMALL_CACHE_READ_COUNT(counter, n) ((void)0)
+#define SMALL_CACHE_READ_RECORD(hist, v) ((void)0)
+#define SMALL_CACHE_READ_TIME_SCOPE(hist) ((void)0)
+#endif
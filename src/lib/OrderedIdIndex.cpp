@@ -0,0 +1,37 @@
+#include "OrderedIdIndex.h"
+#include <stdexcept>
+
+OrderedIdIndex::OrderedIdIndex(std::vector<std::string_view> keys) : count(keys.size())
+{
+    std::ranges::sort(keys);
+    blocks.reserve(keys.size() / blockSize + 1);
+    std::string_view previous;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        const auto key = keys[i];
+        size_t shared = 0;
+        if (i % blockSize == 0)
+        {
+            if (data.size() > UINT32_MAX)
+                throw std::runtime_error("Ordered id index exceeds 4 GiB");
+            blocks.push_back(static_cast<uint32_t>(data.size()));
+        }
+        else
+        {
+            shared = static_cast<size_t>(std::ranges::mismatch(key, previous).in1 - key.begin());
+        }
+        put_varint(data, shared);
+        put_varint(data, key.size() - shared);
+        data.append(key.substr(shared));
+        previous = key;
+    }
+    data.shrink_to_fit();
+}
+
+std::string_view OrderedIdIndex::head(uint32_t offset) const noexcept
+{
+    const char* p = data.data() + offset;
+    get_varint(p); // always 0 for a block head
+    const auto length = get_varint(p);
+    return {p, length};
+}
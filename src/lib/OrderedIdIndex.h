@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Varint.h"
+
+// Sorted, front-coded snapshot of the cache ids. Keys are grouped in blocks of `blockSize`; the
+// first key of a block is stored whole and the others as (shared prefix length, suffix) against
+// their predecessor, so hierarchical ids like "tenant:category:sku" cost little more than their
+// distinct tails. Lookups binary-search the block heads and decode one block forward.
+class OrderedIdIndex
+{
+public:
+    static constexpr size_t blockSize = 16;
+
+    OrderedIdIndex() = default;
+    explicit OrderedIdIndex(std::vector<std::string_view> keys);
+
+    [[nodiscard]] size_t size() const noexcept { return count; }
+    [[nodiscard]] size_t bytes() const noexcept { return data.capacity() + blocks.capacity() * sizeof(uint32_t); }
+
+    // Calls f(key) for every key >= lo in ascending order until f returns false.
+    template <class F>
+    void visit_from(std::string_view lo, F&& f) const
+    {
+        if (blocks.empty())
+            return;
+        const auto after = std::ranges::upper_bound(blocks, lo, {}, [&](uint32_t offset) { return head(offset); });
+        const size_t first = after == blocks.begin() ? 0 : static_cast<size_t>(after - blocks.begin()) - 1;
+
+        std::string key;
+        const char* p = data.data() + blocks[first];
+        const char* const end = data.data() + data.size();
+        while (p != end)
+        {
+            const auto shared = get_varint(p);
+            const auto length = get_varint(p);
+            key.resize(shared);
+            key.append(p, length);
+            p += length;
+            if (key >= lo && !f(std::string_view{key}))
+                return;
+        }
+    }
+
+private:
+    [[nodiscard]] std::string_view head(uint32_t offset) const noexcept;
+
+    std::string data;
+    std::vector<uint32_t> blocks; // offset in `data` of each block's first key
+    size_t count = 0;
+};
@@ -0,0 +1,279 @@
+#include "PageParser.h"
+#include "Overloaded.h"
+#include <format>
+#include <stdexcept>
+
+#ifdef SMALL_CACHE_HAS_SIMDJSON
+#include <simdjson.h>
+#endif
+
+namespace
+{
+    using AttributeValue = SmallCache::AttributeValue;
+    using fwStr = SmallCache::fwStr;
+    using fwStrVec = SmallCache::fwStrVec;
+
+    class GlazePageParser final : public PageParser
+    {
+    public:
+        [[nodiscard]] SmallCache::ParsedPage parse(std::string_view json_text, size_t,
+                                                   const SmallCache::AttrMap& attrMap) const override
+        {
+            json::Response resp;
+            if (auto ce = glz::read<glz::opts{.null_terminated = false, .error_on_unknown_keys = false}>(
+                resp, json_text))
+                throw std::runtime_error(glz::format_error(ce, json_text));
+
+            SmallCache::ParsedPage page;
+            page.count = resp.result.count;
+            page.pages = resp.result.pagination.pages;
+            page.items.reserve(resp.result.data.size());
+            for (auto& item : resp.result.data)
+            {
+                auto& parsed = page.items.emplace_back(std::move(item.id));
+                parsed.attrs.reserve(item.attributes.size());
+                for (auto& attr : item.attributes)
+                {
+                    if (auto it = attrMap.find(attr.id); it != attrMap.end())
+                    {
+                        parsed.attrs.emplace_back(it->second, convert_value(attr.value));
+                    }
+                }
+            }
+            return page;
+        }
+
+        [[nodiscard]] ParserBackend backend() const noexcept override
+        {
+            return ParserBackend::Glaze;
+        }
+
+    private:
+        static AttributeValue convert_value(json::AttributeValue& src)
+        {
+            return std::visit(overloaded{
+                                  [](bool b) -> AttributeValue { return b; },
+                                  [](double d) -> AttributeValue { return d; },
+                                  [](std::string& s) -> AttributeValue { return fwStr{std::move(s)}; },
+                                  [](std::vector<glz::raw_json>& json_vec) -> AttributeValue
+                                  {
+                                      std::vector<fwStr> out;
+                                      out.reserve(json_vec.size());
+                                      for (auto& r : json_vec)
+                                          if (!r.str.empty())
+                                              out.emplace_back(std::move(r.str));
+                                      return fwStrVec{std::move(out)};
+                                  },
+                                  [](std::optional<glz::raw_json>& o) -> AttributeValue
+                                  {
+                                      return o ? fwStr{std::move(o->str)} : fwStr{};
+                                  },
+                              },
+                              src);
+        }
+    };
+
+#ifdef SMALL_CACHE_HAS_SIMDJSON
+    namespace od = simdjson::ondemand;
+
+    // Mirrors the glaze backend: list elements and non-scalar values are kept as raw JSON text.
+    class SimdjsonPageParser final : public PageParser
+    {
+    public:
+        [[nodiscard]] SmallCache::ParsedPage parse(std::string_view json_text, size_t readable,
+                                                   const SmallCache::AttrMap& attrMap) const override
+        {
+            // the on-demand parser and the padded copy of the input are reused across calls on this thread
+            thread_local od::parser parser;
+            thread_local std::string padded;
+            // copy only when too few readable bytes follow the document to parse it in place
+            const bool inPlace = readable >= json_text.size() + simdjson::SIMDJSON_PADDING;
+            if (!inPlace)
+            {
+                padded.reserve(json_text.size() + simdjson::SIMDJSON_PADDING);
+                padded.assign(json_text);
+            }
+            const simdjson::padded_string_view input =
+                inPlace ? simdjson::padded_string_view(json_text.data(), json_text.size(), readable)
+                        : simdjson::padded_string_view(padded.data(), padded.size(), padded.capacity());
+
+            SmallCache::ParsedPage page;
+            try
+            {
+                od::document doc = parser.iterate(input);
+                for (auto field : doc["result"].get_object())
+                {
+                    const std::string_view key = field.unescaped_key();
+                    if (key == "count")
+                    {
+                        page.count = field.value().get_uint64();
+                    }
+                    else if (key == "pagination")
+                    {
+                        page.pages = field.value()["pages"].get_uint64();
+                    }
+                    else if (key == "data")
+                    {
+                        for (auto item : field.value().get_array())
+                        {
+                            parse_item(item.get_object(), attrMap, page.items.emplace_back());
+                        }
+                    }
+                }
+            }
+            catch (const simdjson::simdjson_error& e)
+            {
+                throw std::runtime_error(e.what());
+            }
+            return page;
+        }
+
+        [[nodiscard]] ParserBackend backend() const noexcept override
+        {
+            return ParserBackend::Simdjson;
+        }
+
+    private:
+        static void parse_item(od::object item, const SmallCache::AttrMap& attrMap, SmallCache::ParsedItem& out)
+        {
+            for (auto field : item)
+            {
+                const std::string_view key = field.unescaped_key();
+                if (key == "id")
+                {
+                    out.id = std::string_view(field.value().get_string());
+                }
+                else if (key == "attributes")
+                {
+                    for (auto attr : field.value().get_array())
+                    {
+                        od::object obj = attr.get_object();
+                        const std::string_view name = obj["id"].get_string();
+                        if (auto it = attrMap.find(name); it != attrMap.end())
+                        {
+                            out.attrs.emplace_back(it->second, convert_value(obj["value"].value()));
+                        }
+                    }
+                }
+            }
+        }
+
+        static std::string_view trimmed(std::string_view raw)
+        {
+            while (!raw.empty() && (raw.back() == ' ' || raw.back() == '\n' || raw.back() == '\r' ||
+                raw.back() == '\t'))
+                raw.remove_suffix(1);
+            return raw;
+        }
+
+        static AttributeValue convert_value(od::value value)
+        {
+            const od::json_type type = value.type();
+            switch (type)
+            {
+            case od::json_type::boolean:
+                return bool(value.get_bool());
+            case od::json_type::number:
+                return double(value.get_double());
+            case od::json_type::string:
+                return fwStr{std::string(std::string_view(value.get_string()))};
+            case od::json_type::array:
+                {
+                    std::vector<fwStr> out;
+                    for (auto element : value.get_array())
+                    {
+                        od::value v = element.value();
+                        if (const auto raw = trimmed(v.raw_json()); !raw.empty())
+                            out.emplace_back(std::string(raw));
+                    }
+                    out.shrink_to_fit();
+                    return fwStrVec{std::move(out)};
+                }
+            case od::json_type::null:
+                return fwStr{};
+            default:
+                return fwStr{std::string(trimmed(value.raw_json()))};
+            }
+        }
+    };
+#endif
+}
+
+bool page_parser_available(ParserBackend backend) noexcept
+{
+    switch (backend)
+    {
+    case ParserBackend::Glaze:
+        return true;
+    case ParserBackend::Simdjson:
+#ifdef SMALL_CACHE_HAS_SIMDJSON
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+std::unique_ptr<PageParser> make_page_parser(ParserBackend backend)
+{
+    switch (backend)
+    {
+    case ParserBackend::Glaze:
+        return std::make_unique<GlazePageParser>();
+    case ParserBackend::Simdjson:
+#ifdef SMALL_CACHE_HAS_SIMDJSON
+        return std::make_unique<SimdjsonPageParser>();
+#else
+        throw std::runtime_error("small_cache was built without simdjson support");
+#endif
+    }
+    throw std::runtime_error("Unknown parser backend");
+}
+
+std::vector<std::string_view> split_json_documents(std::string_view stream)
+{
+    std::vector<std::string_view> out;
+    size_t pos = 0;
+    while (pos < stream.size())
+    {
+        const char c = stream[pos];
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+        {
+            ++pos;
+            continue;
+        }
+        if (c != '{' && c != '[')
+        {
+            throw std::runtime_error(std::format("Unexpected '{}' at offset {} of JSON stream", c, pos));
+        }
+
+        const size_t start = pos;
+        size_t depth = 0;
+        bool in_string = false;
+        for (; pos < stream.size(); ++pos)
+        {
+            const char ch = stream[pos];
+            if (in_string)
+            {
+                if (ch == '\\')
+                    ++pos;
+                else if (ch == '"')
+                    in_string = false;
+            }
+            else if (ch == '"')
+                in_string = true;
+            else if (ch == '{' || ch == '[')
+                ++depth;
+            else if ((ch == '}' || ch == ']') && --depth == 0)
+                break;
+        }
+        if (pos >= stream.size())
+        {
+            throw std::runtime_error(std::format("Unterminated JSON document at offset {} of JSON stream", start));
+        }
+        ++pos;
+        out.push_back(stream.substr(start, pos - start));
+    }
+    return out;
+}
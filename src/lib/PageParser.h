@@ -0,0 +1,26 @@
+#pragma once
+
+#include "SmallCache.h"
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Turns one API page into SmallCache::ParsedPage. Implementations must not touch the cache itself,
+// so several pages can be parsed concurrently and inserted afterwards.
+class PageParser
+{
+public:
+    virtual ~PageParser() = default;
+
+    // `readable` is how many bytes starting at json_text.data() may be read, at least json_text.size();
+    // a parser that reads past the end of the document, like simdjson, can then skip copying it.
+    [[nodiscard]] virtual SmallCache::ParsedPage parse(std::string_view json_text, size_t readable,
+                                                       const SmallCache::AttrMap& attrMap) const = 0;
+    [[nodiscard]] virtual ParserBackend backend() const noexcept = 0;
+};
+
+[[nodiscard]] bool page_parser_available(ParserBackend backend) noexcept;
+[[nodiscard]] std::unique_ptr<PageParser> make_page_parser(ParserBackend backend);
+
+// Splits concatenated or newline-delimited JSON documents into views of the individual documents.
+[[nodiscard]] std::vector<std::string_view> split_json_documents(std::string_view stream);
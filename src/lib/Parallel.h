@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+// Number of ranges parallel_for_each_range uses for `size` elements; threads == 0 means one per core.
+inline size_t partition_count(size_t size, size_t threads)
+{
+    constexpr size_t min_chunk = 4096;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::clamp<size_t>(size / min_chunk, 1, threads);
+}
+
+// Splits [map.begin(), map.end()) into up to `threads` contiguous ranges and calls
+// f(first, last, part) for each one, part 0 on the calling thread. The map must not be modified
+// meanwhile. The first exception thrown by any part is rethrown after all parts have finished.
+template <class Map, class F>
+void parallel_for_each_range(const Map& map, size_t threads, F&& f)
+{
+    const size_t parts = partition_count(map.size(), threads);
+
+    using Iterator = typename Map::const_iterator;
+    std::vector<Iterator> bounds;
+    bounds.reserve(parts + 1);
+    bounds.push_back(map.begin());
+    const size_t step = map.size() / parts;
+    for (size_t p = 1; p < parts; ++p)
+        bounds.push_back(std::next(bounds.back(), static_cast<std::ptrdiff_t>(step)));
+    bounds.push_back(map.end());
+
+    std::vector<std::exception_ptr> errors(parts);
+    {
+        std::vector<std::jthread> workers;
+        workers.reserve(parts - 1);
+        const auto run = [&](size_t p)
+        {
+            try
+            {
+                f(bounds[p], bounds[p + 1], p);
+            }
+            catch (...)
+            {
+                errors[p] = std::current_exception();
+            }
+        };
+        for (size_t p = 1; p < parts; ++p)
+            workers.emplace_back(run, p);
+        run(0);
+    }
+    for (const auto& e : errors)
+    {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
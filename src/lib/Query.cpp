@@ -0,0 +1,418 @@
+#include "Query.h"
+#include "Overloaded.h"
+#include "Parallel.h"
+#include "OrderedIdIndex.h"
+#include <absl/container/flat_hash_map.h>
+#include <atomic>
+#include <bit>
+#include <limits>
+
+namespace
+{
+    using AttributeValue = SmallCache::AttributeValue;
+
+    AttributeValue intern_operand(const SmallCache::pyAttrValue& value)
+    {
+        return std::visit(overloaded{
+                              [](std::monostate) -> AttributeValue { return std::monostate{}; },
+                              [](bool b) -> AttributeValue { return b; },
+                              [](double d) -> AttributeValue { return d; },
+                              [](const std::string& s) -> AttributeValue { return SmallCache::fwStr{s}; },
+                              [](const SmallCache::strVec& vec) -> AttributeValue
+                              {
+                                  std::vector<SmallCache::fwStr> out(vec.begin(), vec.end());
+                                  return SmallCache::fwStrVec{std::move(out)};
+                              },
+                          },
+                          value);
+    }
+
+    bool same_value(const AttributeValue& a, const AttributeValue& b)
+    {
+        if (a.index() != b.index())
+            return false;
+        if (const void* id = interned_identity(a))
+            return id == interned_identity(b);
+        return a == b;
+    }
+
+    // <0, 0, >0 like strcmp; nullopt when the values are not comparable
+    std::optional<int> compare(const AttributeValue& a, const AttributeValue& b)
+    {
+        if (a.index() != b.index())
+            return std::nullopt;
+        if (const auto* x = std::get_if<double>(&a))
+        {
+            const double y = std::get<double>(b);
+            return *x < y ? -1 : *x > y ? 1 : 0;
+        }
+        if (const auto* x = std::get_if<bool>(&a))
+            return int(*x) - int(std::get<bool>(b));
+        if (const auto* x = std::get_if<SmallCache::fwStr>(&a))
+            return x->get().compare(std::get<SmallCache::fwStr>(b).get());
+        return std::nullopt;
+    }
+
+    // (alternative, payload) of a stored value: interned strings and lists by identity, numbers by
+    // their bits. Missing and null values share the empty key.
+    using ValueKey = std::pair<uint8_t, uint64_t>;
+
+    ValueKey value_key(const AttributeValue& value) noexcept
+    {
+        const auto alternative = static_cast<uint8_t>(value.index());
+        if (const void* id = interned_identity(value))
+            return {alternative, reinterpret_cast<uintptr_t>(id)};
+        if (const auto* d = std::get_if<double>(&value))
+            return {alternative, std::bit_cast<uint64_t>(*d == 0.0 ? 0.0 : *d)};
+        if (const auto* b = std::get_if<bool>(&value))
+            return {alternative, uint64_t{*b}};
+        return {};
+    }
+
+    struct Accumulator
+    {
+        uint64_t count = 0;
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        absl::flat_hash_set<ValueKey> distinct;
+
+        void add(SmallCache::Metric::Kind kind, const AttributeValue& value)
+        {
+            using Kind = SmallCache::Metric::Kind;
+            if (kind == Kind::Count)
+            {
+                ++count;
+                return;
+            }
+            if (kind == Kind::CountDistinct)
+            {
+                distinct.insert(value_key(value));
+                return;
+            }
+            if (const auto* d = std::get_if<double>(&value))
+            {
+                ++count;
+                sum += *d;
+                min = std::min(min, *d);
+                max = std::max(max, *d);
+            }
+        }
+
+        void merge(Accumulator&& other)
+        {
+            count += other.count;
+            sum += other.sum;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+            if (distinct.size() < other.distinct.size())
+                std::swap(distinct, other.distinct);
+            distinct.insert(other.distinct.begin(), other.distinct.end());
+        }
+
+        [[nodiscard]] std::optional<double> result(SmallCache::Metric::Kind kind) const
+        {
+            using Kind = SmallCache::Metric::Kind;
+            switch (kind)
+            {
+            case Kind::Count:
+                return static_cast<double>(count);
+            case Kind::CountDistinct:
+                return static_cast<double>(distinct.size());
+            case Kind::Sum:
+                return sum;
+            case Kind::Min:
+                return count ? std::optional{min} : std::nullopt;
+            case Kind::Max:
+                return count ? std::optional{max} : std::nullopt;
+            }
+            return std::nullopt;
+        }
+    };
+
+    struct Group
+    {
+        std::vector<AttributeValue> key;
+        std::vector<Accumulator> accumulators;
+    };
+
+    using GroupTable = absl::flat_hash_map<std::vector<ValueKey>, Group>;
+}
+
+const void* interned_identity(const AttributeValue& value) noexcept
+{
+    if (const auto* s = std::get_if<SmallCache::fwStr>(&value))
+        return &s->get();
+    if (const auto* l = std::get_if<SmallCache::fwStrVec>(&value))
+        return &l->get();
+    return nullptr;
+}
+
+CompiledFilter::CompiledFilter(const SmallCache::Filter& filter, const SmallCache::AttrMap& attrMap) :
+    root(compile(filter, attrMap))
+{
+}
+
+CompiledFilter::Node CompiledFilter::compile(const SmallCache::Filter& filter, const SmallCache::AttrMap& attrMap)
+{
+    Node node;
+    node.op = filter.op;
+    if (filter.op == Op::And || filter.op == Op::Or)
+    {
+        node.children.reserve(filter.children.size());
+        for (const auto& child : filter.children)
+            node.children.push_back(compile(child, attrMap));
+        return node;
+    }
+
+    if (const auto it = attrMap.find(filter.attribute); it != attrMap.end())
+        node.idx = it->second;
+    const bool single = filter.op != Op::In && filter.op != Op::Has;
+    if (single && filter.values.size() != 1)
+        throw std::runtime_error("Filter on '" + filter.attribute + "' needs exactly one value");
+    if (filter.op == Op::Contains && !std::holds_alternative<SmallCache::str>(filter.values[0]))
+        throw std::runtime_error("'contains' filter on '" + filter.attribute + "' needs a string value");
+
+    for (const auto& value : filter.values)
+    {
+        auto operand = intern_operand(value);
+        if (filter.op == Op::In && std::holds_alternative<SmallCache::fwStr>(operand))
+            node.identities.insert(interned_identity(operand));
+        node.operands.push_back(std::move(operand));
+    }
+    return node;
+}
+
+bool CompiledFilter::matches(const SmallCache::MarkedItem& item) const
+{
+    return matches(root, item);
+}
+
+bool CompiledFilter::matches(const Node& node, const SmallCache::MarkedItem& item)
+{
+    switch (node.op)
+    {
+    case Op::And:
+        return std::ranges::all_of(node.children, [&](const Node& c) { return matches(c, item); });
+    case Op::Or:
+        return std::ranges::any_of(node.children, [&](const Node& c) { return matches(c, item); });
+    default:
+        break;
+    }
+
+    const auto ref = node.idx ? item.getValue(*node.idx) : std::nullopt;
+    if (!ref || std::holds_alternative<std::monostate>(ref->get()))
+        return node.op == Op::Ne;
+    const AttributeValue& value = ref->get();
+
+    switch (node.op)
+    {
+    case Op::Eq:
+        return same_value(value, node.operands[0]);
+    case Op::Ne:
+        return !same_value(value, node.operands[0]);
+    case Op::Lt:
+        return compare(value, node.operands[0]).value_or(0) < 0;
+    case Op::Gt:
+        return compare(value, node.operands[0]).value_or(0) > 0;
+    case Op::In:
+        if (const auto* s = std::get_if<SmallCache::fwStr>(&value))
+            return node.identities.contains(&s->get());
+        return std::ranges::any_of(node.operands, [&](const AttributeValue& o) { return same_value(value, o); });
+    case Op::Contains:
+        if (const auto* list = std::get_if<SmallCache::fwStrVec>(&value))
+        {
+            const void* needle = interned_identity(node.operands[0]);
+            return std::ranges::any_of(list->get(), [&](const SmallCache::fwStr& e) { return &e.get() == needle; });
+        }
+        return false;
+    case Op::Has:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::vector<SmallCache::Row> SmallCache::scan(const Filter& filter, const strVec& attributes, size_t limit,
+                                              size_t threads) const
+{
+    SMALL_CACHE_TIME_SCOPE(scan_ns);
+    const ReadLock lock(mutex);
+    const CompiledFilter compiled(filter, attrMap);
+    const auto idxs = resolveAttributes(attributes);
+    if (limit == 0)
+        limit = std::numeric_limits<size_t>::max();
+
+    std::vector<std::vector<Row>> partials(partition_count(cache.size(), threads));
+    std::atomic<size_t> matched{0};
+    parallel_for_each_range(cache, threads, [&](auto first, auto last, size_t part)
+    {
+        auto& out = partials[part];
+        for (auto it = first; it != last && matched.load(std::memory_order_relaxed) < limit; ++it)
+        {
+            if (!compiled.matches(it->second) || isExpired(it->first, it->second))
+                continue;
+            matched.fetch_add(1, std::memory_order_relaxed);
+            out.emplace_back(it->first, project(it->second, idxs));
+        }
+    });
+
+    std::vector<Row> rows;
+    for (auto& part : partials)
+    {
+        for (auto& row : part)
+        {
+            if (rows.size() == limit)
+                return rows;
+            rows.push_back(std::move(row));
+        }
+    }
+    return rows;
+}
+
+SmallCache::Metric SmallCache::Metric::parse(std::string_view spec)
+{
+    static constexpr std::pair<std::string_view, Kind> kinds[] = {
+        {"count", Kind::Count}, {"sum", Kind::Sum}, {"min", Kind::Min},
+        {"max", Kind::Max}, {"count_distinct", Kind::CountDistinct},
+    };
+    const auto open = spec.find('(');
+    const auto kind = std::ranges::find(kinds, spec.substr(0, open), &std::pair<std::string_view, Kind>::first);
+    if (kind == std::end(kinds))
+        throw std::runtime_error("Unknown metric '" + str(spec) + "'");
+
+    Metric metric{.kind = kind->second};
+    if (open == std::string_view::npos)
+    {
+        if (metric.kind != Kind::Count)
+            throw std::runtime_error("Metric '" + str(spec) + "' needs an attribute");
+        return metric;
+    }
+    if (!spec.ends_with(')') || spec.size() == open + 2)
+        throw std::runtime_error("Malformed metric '" + str(spec) + "'");
+    metric.attribute = str(spec.substr(open + 1, spec.size() - open - 2));
+    return metric;
+}
+
+std::vector<SmallCache::AggregateRow> SmallCache::aggregate(const strVec& group_by, const std::vector<Metric>& metrics,
+                                                            size_t threads) const
+{
+    SMALL_CACHE_TIME_SCOPE(aggregate_ns);
+    const ReadLock lock(mutex);
+    const auto keyIdxs = resolveAttributes(group_by);
+    strVec metricAttributes;
+    for (const auto& metric : metrics)
+        metricAttributes.push_back(metric.attribute);
+    const auto metricIdxs = resolveAttributes(metricAttributes);
+
+    std::vector<GroupTable> partials(partition_count(cache.size(), threads));
+    parallel_for_each_range(cache, threads, [&](auto first, auto last, size_t part)
+    {
+        auto& groups = partials[part];
+        std::vector<ValueKey> key(keyIdxs.size());
+        for (auto it = first; it != last; ++it)
+        {
+            const MarkedItem& item = it->second;
+            if (isExpired(it->first, item))
+                continue;
+            for (size_t k = 0; k < keyIdxs.size(); ++k)
+            {
+                const auto value = keyIdxs[k] ? item.getValue(*keyIdxs[k]) : std::nullopt;
+                key[k] = value ? value_key(*value) : ValueKey{};
+            }
+
+            auto group = groups.find(key);
+            if (group == groups.end())
+            {
+                Group fresh{.accumulators = std::vector<Accumulator>(metrics.size())};
+                fresh.key.reserve(keyIdxs.size());
+                for (const auto& idx : keyIdxs)
+                {
+                    const auto value = idx ? item.getValue(*idx) : std::nullopt;
+                    fresh.key.push_back(value ? value->get() : AttributeValue{});
+                }
+                group = groups.emplace(key, std::move(fresh)).first;
+            }
+
+            auto& accumulators = group->second.accumulators;
+            for (size_t m = 0; m < metrics.size(); ++m)
+            {
+                if (metrics[m].attribute.empty())
+                {
+                    ++accumulators[m].count;
+                    continue;
+                }
+                const auto value = metricIdxs[m] ? item.getValue(*metricIdxs[m]) : std::nullopt;
+                if (value && !std::holds_alternative<std::monostate>(value->get()))
+                    accumulators[m].add(metrics[m].kind, *value);
+            }
+        }
+    });
+
+    auto& merged = partials.front();
+    for (size_t p = 1; p < partials.size(); ++p)
+    {
+        for (auto& [key, group] : partials[p])
+        {
+            auto [it, inserted] = merged.try_emplace(key, std::move(group));
+            if (inserted)
+                continue;
+            for (size_t m = 0; m < metrics.size(); ++m)
+                it->second.accumulators[m].merge(std::move(group.accumulators[m]));
+        }
+    }
+
+    std::vector<AggregateRow> rows;
+    rows.reserve(merged.size());
+    for (const auto& [key, group] : merged)
+    {
+        AggregateRow row;
+        row.key.reserve(group.key.size());
+        for (const auto& value : group.key)
+            row.key.push_back(convert_value(value));
+        row.values.reserve(metrics.size());
+        for (size_t m = 0; m < metrics.size(); ++m)
+            row.values.push_back(group.accumulators[m].result(metrics[m].kind));
+        rows.push_back(std::move(row));
+    }
+    return rows;
+}
+
+template <class Keep>
+std::vector<SmallCache::Row> SmallCache::orderedScan(std::string_view lo, Keep&& keep, const strVec& attributes,
+                                                     size_t limit) const
+{
+    SMALL_CACHE_TIME_SCOPE(ordered_scan_ns);
+    const ReadLock lock(mutex);
+    if (!orderedIndex)
+        throw std::runtime_error("Ordered id index is not enabled");
+    const auto idxs = resolveAttributes(attributes);
+    if (limit == 0)
+        limit = std::numeric_limits<size_t>::max();
+
+    std::vector<Row> rows;
+    str probe;
+    orderedIndex->visit_from(lo, [&](std::string_view key)
+    {
+        if (!keep(key))
+            return false;
+        // the index is a snapshot: skip ids evicted or expired since it was built
+        probe.assign(key);
+        const auto it = cache.find(probe);
+        if (it != cache.end() && !isExpired(it->first, it->second))
+            rows.emplace_back(it->first, project(it->second, idxs));
+        return rows.size() < limit;
+    });
+    return rows;
+}
+
+std::vector<SmallCache::Row> SmallCache::prefix_scan(const str& prefix, const strVec& attributes, size_t limit) const
+{
+    return orderedScan(prefix, [&](std::string_view key) { return key.starts_with(prefix); }, attributes, limit);
+}
+
+std::vector<SmallCache::Row> SmallCache::range_scan(const str& lo, const std::optional<str>& hi,
+                                                    const strVec& attributes, size_t limit) const
+{
+    return orderedScan(lo, [&](std::string_view key) { return !hi || key < *hi; }, attributes, limit);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "SmallCache.h"
+#include <absl/container/flat_hash_set.h>
+
+// SmallCache::Filter resolved against one cache: attribute names become indices and string operands
+// become interned handles, so matching compares string identities instead of text.
+class CompiledFilter
+{
+public:
+    CompiledFilter(const SmallCache::Filter& filter, const SmallCache::AttrMap& attrMap);
+
+    [[nodiscard]] bool matches(const SmallCache::MarkedItem& item) const;
+
+private:
+    using Op = SmallCache::Filter::Op;
+
+    struct Node
+    {
+        Op op = Op::And;
+        std::optional<uint8_t> idx;
+        std::vector<SmallCache::AttributeValue> operands;
+        absl::flat_hash_set<const void*> identities; // In: interned strings among the operands
+        std::vector<Node> children;
+    };
+
+    static Node compile(const SmallCache::Filter& filter, const SmallCache::AttrMap& attrMap);
+    static bool matches(const Node& node, const SmallCache::MarkedItem& item);
+
+    Node root;
+};
+
+// Identity of an interned string or list, null for other values.
+[[nodiscard]] const void* interned_identity(const SmallCache::AttributeValue& value) noexcept;
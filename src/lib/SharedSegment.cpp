@@ -0,0 +1,430 @@
+#include "SharedSegment.h"
+#include "Overloaded.h"
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <algorithm>
+#include <format>
+
+namespace bip = boost::interprocess;
+using namespace shared_segment;
+
+namespace
+{
+    constexpr uint64_t align8(uint64_t n) noexcept
+    {
+        return (n + 7) & ~uint64_t{7};
+    }
+
+    template <class T>
+    const T* at(const char* base, uint64_t offset) noexcept
+    {
+        return reinterpret_cast<const T*>(base + offset);
+    }
+
+    std::string_view pool_string(const char* base, uint64_t offset) noexcept
+    {
+        return {base + offset + sizeof(uint64_t), *at<uint64_t>(base, offset)};
+    }
+
+    template <class T>
+    void append_bytes(std::string& out, const T* data, size_t count)
+    {
+        out.append(reinterpret_cast<const char*>(data), count * sizeof(T));
+    }
+}
+
+std::string shared_segment::segment_name(std::string_view name, uint64_t generation)
+{
+    return std::format("{}.{}", name, generation);
+}
+
+std::string SmallCache::buildSharedImage(uint64_t generation) const
+{
+    std::vector<std::pair<const str*, const MarkedItem*>> live;
+    live.reserve(cache.size());
+    uint64_t valueCount = 0;
+    for (const auto& [id, item] : cache)
+    {
+        if (!isExpired(id, item))
+        {
+            live.emplace_back(&id, &item);
+            valueCount += item.value.size();
+        }
+    }
+    if (live.size() >= UINT32_MAX)
+        throw std::runtime_error("Too many items for a shared segment");
+
+    Header header{.magic = magic, .generation = generation};
+    header.attributeCount = attrIdx.size();
+    header.attributeNames = sizeof(Header);
+    header.itemCount = live.size();
+    header.items = header.attributeNames + attrIdx.size() * sizeof(uint64_t);
+    header.bucketCount = std::bit_ceil(std::max<uint64_t>(8, live.size() * 2));
+    header.buckets = header.items + live.size() * sizeof(Item);
+    header.values = align8(header.buckets + header.bucketCount * sizeof(uint32_t));
+    const uint64_t poolBase = header.values + valueCount * sizeof(Value);
+
+    std::string pool;
+    absl::flat_hash_map<const void*, uint64_t> interned; // string or list identity -> pool offset
+    const auto addString = [&](std::string_view s)
+    {
+        const uint64_t offset = poolBase + pool.size();
+        const uint64_t length = s.size();
+        append_bytes(pool, &length, 1);
+        pool.append(s);
+        pool.resize(align8(pool.size()), '\0');
+        return offset;
+    };
+    const auto internString = [&](const fwStr& s)
+    {
+        auto [it, inserted] = interned.try_emplace(&s.get());
+        if (inserted)
+            it->second = addString(s.get());
+        return it->second;
+    };
+    const auto internList = [&](const fwStrVec& list)
+    {
+        if (const auto it = interned.find(&list.get()); it != interned.end())
+            return it->second;
+        std::vector<uint64_t> elements;
+        elements.reserve(list.get().size());
+        for (const auto& s : list.get())
+            elements.push_back(internString(s));
+        const uint64_t offset = poolBase + pool.size();
+        const uint64_t count = elements.size();
+        append_bytes(pool, &count, 1);
+        append_bytes(pool, elements.data(), elements.size());
+        interned.emplace(&list.get(), offset);
+        return offset;
+    };
+
+    std::vector<uint64_t> names;
+    names.reserve(attrIdx.size());
+    for (const auto& name : attrIdx)
+        names.push_back(addString(name));
+
+    std::vector<Item> items;
+    std::vector<Value> values;
+    items.reserve(live.size());
+    values.reserve(valueCount);
+    std::vector<uint32_t> buckets(header.bucketCount, 0);
+    const uint64_t mask = header.bucketCount - 1;
+    for (const auto& [id, item] : live)
+    {
+        items.push_back({.id = addString(*id), .firstValue = values.size(), .flags = item->attrs_flags,
+                         .valueCount = static_cast<uint32_t>(item->value.size())});
+        for (const auto& value : item->value)
+        {
+            values.push_back(std::visit(overloaded{
+                                            [](std::monostate) { return Value{.type = ValueType::Null, .payload = 0}; },
+                                            [](double d) { return Value{.type = ValueType::Double, .payload = std::bit_cast<uint64_t>(d)}; },
+                                            [](bool b) { return Value{.type = ValueType::Bool, .payload = uint64_t{b}}; },
+                                            [&](const fwStr& s) { return Value{.type = ValueType::String, .payload = internString(s)}; },
+                                            [&](const fwStrVec& l) { return Value{.type = ValueType::List, .payload = internList(l)}; },
+                                        },
+                                        value));
+        }
+        uint64_t b = shared_segment::hash(*id) & mask;
+        while (buckets[b] != 0)
+            b = (b + 1) & mask;
+        buckets[b] = static_cast<uint32_t>(items.size());
+    }
+
+    header.size = poolBase + pool.size();
+    std::string image;
+    image.reserve(header.size);
+    append_bytes(image, &header, 1);
+    append_bytes(image, names.data(), names.size());
+    append_bytes(image, items.data(), items.size());
+    append_bytes(image, buckets.data(), buckets.size());
+    image.resize(header.values, '\0');
+    append_bytes(image, values.data(), values.size());
+    image.append(pool);
+    return image;
+}
+
+uint64_t SmallCache::publish_shared(const str& name) const
+{
+    try
+    {
+        bip::shared_memory_object controlObject(bip::open_or_create, name.c_str(), bip::read_write);
+        bip::offset_t controlSize = 0;
+        if (!controlObject.get_size(controlSize) || controlSize < static_cast<bip::offset_t>(sizeof(Control)))
+            controlObject.truncate(sizeof(Control)); // zero-filled: generation 0, nothing published
+        bip::mapped_region controlRegion(controlObject, bip::read_write);
+        auto& control = *static_cast<Control*>(controlRegion.get_address());
+
+        // a generation no other publisher gets; also past `generation` for control objects that
+        // predate the reservation counter
+        uint64_t reserved = control.reserved.load(std::memory_order_relaxed);
+        uint64_t generation;
+        do
+        {
+            generation = std::max(reserved, control.generation.load(std::memory_order_acquire)) + 1;
+        }
+        while (!control.reserved.compare_exchange_weak(reserved, generation, std::memory_order_acq_rel));
+
+        std::string image;
+        {
+            const ReadLock lock(mutex);
+            image = buildSharedImage(generation);
+        }
+        const auto segment = segment_name(name, generation);
+        bip::shared_memory_object::remove(segment.c_str()); // left over by a crashed publisher
+        {
+            bip::shared_memory_object object(bip::create_only, segment.c_str(), bip::read_write);
+            object.truncate(static_cast<bip::offset_t>(image.size()));
+            bip::mapped_region region(object, bip::read_write);
+            std::memcpy(region.get_address(), image.data(), image.size());
+        }
+
+        uint64_t previous = control.generation.load(std::memory_order_acquire);
+        while (previous < generation)
+        {
+            if (control.generation.compare_exchange_weak(previous, generation, std::memory_order_acq_rel))
+            {
+                // readers that already mapped the previous generation keep their mapping
+                if (previous != 0)
+                    bip::shared_memory_object::remove(segment_name(name, previous).c_str());
+                return generation;
+            }
+        }
+        // a publisher that reserved later got there first; its image replaces this one
+        bip::shared_memory_object::remove(segment.c_str());
+        return previous;
+    }
+    catch (const bip::interprocess_exception& e)
+    {
+        throw std::runtime_error(std::format("Cannot publish shared cache {}: {}", name, e.what()));
+    }
+}
+
+void SmallCache::remove_shared(const str& name)
+{
+    try
+    {
+        bip::shared_memory_object controlObject(bip::open_only, name.c_str(), bip::read_only);
+        const bip::mapped_region controlRegion(controlObject, bip::read_only);
+        const auto& control = *static_cast<const Control*>(controlRegion.get_address());
+        bip::shared_memory_object::remove(segment_name(name, control.generation.load()).c_str());
+    }
+    catch (const bip::interprocess_exception&)
+    {
+        // nothing published under this name
+    }
+    bip::shared_memory_object::remove(name.c_str());
+}
+
+struct SharedCacheReader::Mapping
+{
+    explicit Mapping(const str& objectName) :
+        object(bip::open_only, objectName.c_str(), bip::read_only), region(object, bip::read_only)
+    {
+    }
+
+    [[nodiscard]] const char* base() const noexcept { return static_cast<const char*>(region.get_address()); }
+    [[nodiscard]] const Header& header() const noexcept { return *at<Header>(base(), 0); }
+
+    bip::shared_memory_object object;
+    bip::mapped_region region;
+    SmallCache::AttrMap attrMap;
+};
+
+SharedCacheReader::SharedCacheReader(const str& name) : name(name)
+{
+    try
+    {
+        control = std::make_unique<Mapping>(name);
+    }
+    catch (const bip::interprocess_exception& e)
+    {
+        throw std::runtime_error(std::format("Cannot open shared cache {}: {}", name, e.what()));
+    }
+    refresh();
+}
+
+SharedCacheReader::~SharedCacheReader() = default;
+
+std::shared_ptr<const SharedCacheReader::Mapping> SharedCacheReader::pinned() const
+{
+    const std::lock_guard lock(currentMutex);
+    return current;
+}
+
+bool SharedCacheReader::refresh()
+{
+    const auto& generation = static_cast<const Control*>(control->region.get_address())->generation;
+    // a generation can be superseded and removed between reading its number and opening it
+    for (int attempt = 0; attempt < 16; ++attempt)
+    {
+        const uint64_t latest = generation.load(std::memory_order_acquire);
+        const auto mapped = pinned();
+        if (latest == 0 || (mapped && mapped->header().generation == latest))
+            return false;
+        std::shared_ptr<Mapping> next;
+        try
+        {
+            next = std::make_shared<Mapping>(segment_name(name, latest));
+        }
+        catch (const bip::interprocess_exception&)
+        {
+            continue;
+        }
+        if (next->region.get_size() < sizeof(Header) || next->header().magic != magic ||
+            next->header().size > next->region.get_size())
+        {
+            throw std::runtime_error(std::format("Shared cache {} is not a valid segment", name));
+        }
+        const char* base = next->base();
+        const auto* names = at<uint64_t>(base, next->header().attributeNames);
+        for (uint64_t idx = 0; idx < next->header().attributeCount; ++idx)
+        {
+            if (const auto attr = pool_string(base, names[idx]); !attr.empty())
+                next->attrMap.emplace(attr, static_cast<uint8_t>(idx));
+        }
+        // another thread may have mapped this generation meanwhile
+        const std::lock_guard lock(currentMutex);
+        if (current && current->header().generation == latest)
+            return false;
+        current = std::move(next);
+        return true;
+    }
+    throw std::runtime_error(std::format("Cannot map the current generation of shared cache {}", name));
+}
+
+uint64_t SharedCacheReader::generation() const noexcept
+{
+    const auto mapping = pinned();
+    return mapping ? mapping->header().generation : 0;
+}
+
+size_t SharedCacheReader::size() const noexcept
+{
+    const auto mapping = pinned();
+    return mapping ? mapping->header().itemCount : 0;
+}
+
+SharedCacheReader::strVec SharedCacheReader::attributes() const
+{
+    strVec out;
+    const auto mapping = pinned();
+    if (!mapping)
+        return out;
+    const auto* names = at<uint64_t>(mapping->base(), mapping->header().attributeNames);
+    for (uint64_t idx = 0; idx < mapping->header().attributeCount; ++idx)
+    {
+        if (const auto attr = pool_string(mapping->base(), names[idx]); !attr.empty())
+            out.emplace_back(attr);
+    }
+    return out;
+}
+
+const Item* SharedCacheReader::find(const Mapping& mapping, std::string_view id) noexcept
+{
+    const char* base = mapping.base();
+    const auto& header = mapping.header();
+    const auto* items = at<Item>(base, header.items);
+    const auto* buckets = at<uint32_t>(base, header.buckets);
+    const uint64_t mask = header.bucketCount - 1;
+    for (uint64_t b = shared_segment::hash(id) & mask; buckets[b] != 0; b = (b + 1) & mask)
+    {
+        const Item& item = items[buckets[b] - 1];
+        if (pool_string(base, item.id) == id)
+            return &item;
+    }
+    return nullptr;
+}
+
+std::vector<std::optional<uint8_t>> SharedCacheReader::resolve(const Mapping& mapping, const strVec& attributes)
+{
+    std::vector<std::optional<uint8_t>> idxs;
+    idxs.reserve(attributes.size());
+    for (const auto& attr : attributes)
+    {
+        const auto it = mapping.attrMap.find(attr);
+        idxs.push_back(it != mapping.attrMap.end() ? std::optional{it->second} : std::nullopt);
+    }
+    return idxs;
+}
+
+std::vector<SharedCacheReader::pyAttrValue> SharedCacheReader::project(
+    const Mapping& mapping, const Item* item, const std::vector<std::optional<uint8_t>>& idxs)
+{
+    const char* base = mapping.base();
+    const auto* values = at<Value>(base, mapping.header().values) + item->firstValue;
+    std::vector<pyAttrValue> row;
+    row.reserve(idxs.size());
+    for (const auto& idx : idxs)
+    {
+        if (!idx || !((item->flags[*idx / 32] >> (*idx % 32)) & 1u))
+        {
+            row.emplace_back();
+            continue;
+        }
+        size_t slot = std::popcount(item->flags[*idx / 32] & ((1u << (*idx % 32)) - 1));
+        for (size_t w = 0; w < *idx / 32; ++w)
+            slot += std::popcount(item->flags[w]);
+
+        const Value& value = values[slot];
+        switch (value.type)
+        {
+        case ValueType::Double:
+            row.emplace_back(std::bit_cast<double>(value.payload));
+            break;
+        case ValueType::Bool:
+            row.emplace_back(value.payload != 0);
+            break;
+        case ValueType::String:
+            row.emplace_back(str(pool_string(base, value.payload)));
+            break;
+        case ValueType::List:
+            {
+                const auto count = *at<uint64_t>(base, value.payload);
+                const auto* elements = at<uint64_t>(base, value.payload + sizeof(uint64_t));
+                strVec list;
+                list.reserve(count);
+                for (uint64_t i = 0; i < count; ++i)
+                    list.emplace_back(pool_string(base, elements[i]));
+                row.emplace_back(std::move(list));
+                break;
+            }
+        case ValueType::Null:
+            row.emplace_back();
+            break;
+        }
+    }
+    return row;
+}
+
+std::vector<SharedCacheReader::pyAttrValue> SharedCacheReader::get_one(const str& id, const strVec& attributes)
+{
+    refresh();
+    const auto mapping = pinned();
+    if (!mapping || attributes.empty())
+        return {};
+    const auto* item = find(*mapping, id);
+    if (!item)
+        return {};
+    return project(*mapping, item, resolve(*mapping, attributes));
+}
+
+std::vector<std::vector<SharedCacheReader::pyAttrValue>> SharedCacheReader::get_many(const strVec& ids,
+                                                                                     const strVec& attributes)
+{
+    refresh();
+    const auto mapping = pinned();
+    std::vector<std::vector<pyAttrValue>> out;
+    out.reserve(ids.size());
+    if (!mapping)
+    {
+        out.resize(ids.size());
+        return out;
+    }
+    const auto idxs = resolve(*mapping, attributes);
+    for (const auto& id : ids)
+    {
+        const auto* item = find(*mapping, id);
+        out.push_back(item && !attributes.empty() ? project(*mapping, item, idxs) : std::vector<pyAttrValue>{});
+    }
+    return out;
+}
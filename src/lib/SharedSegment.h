@@ -0,0 +1,133 @@
+#pragma once
+
+#include "SmallCache.h"
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <type_traits>
+
+// Pointer-free image of a SmallCache in a named shared-memory object. Everything is addressed by
+// byte offsets from the start of the image, so any process can map it at any address:
+//
+//   Header | attribute names: u64[attributeCount] | items: Item[itemCount]
+//   | buckets: u32[bucketCount] | values: Value[] | pool
+//
+// The pool holds each string once as (u64 length, bytes) and each string list once as
+// (u64 count, u64 string offsets[count]), both padded to 8 bytes. Buckets are an open-addressing
+// table of item index + 1 (0 = empty) under a process-independent hash.
+//
+// Publishing reserves a generation from the small control object "<name>", writes the image as
+// "<name>.<generation>" and then advances the published generation in the control object; readers
+// map the newest generation when they notice the change. Publishers, in any threads or processes,
+// may run concurrently: reservations are unique, and the published generation only moves forward.
+namespace shared_segment
+{
+    inline constexpr uint64_t magic = 0x3147455343534D53; // "SMSCSEG1"
+
+    struct Control
+    {
+        std::atomic<uint64_t> generation; // newest published image, 0 = none
+        std::atomic<uint64_t> reserved;   // highest generation handed to a publisher
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t generation;
+        uint64_t size;
+        uint64_t attributeCount;
+        uint64_t attributeNames;
+        uint64_t itemCount;
+        uint64_t items;
+        uint64_t bucketCount;
+        uint64_t buckets;
+        uint64_t values;
+    };
+
+    enum class ValueType : uint8_t
+    {
+        Null,
+        Double,
+        Bool,
+        String,
+        List,
+    };
+
+    // Images are memcpy'd into shared memory, so the records spell out their padding: implicit
+    // padding bytes would carry whatever the writer's stack held into every reader's mapping.
+    struct Value
+    {
+        ValueType type;
+        uint8_t reserved[7]{};
+        uint64_t payload; // double bits, bool, or pool offset of a string or list
+    };
+    static_assert(std::has_unique_object_representations_v<Value>);
+
+    struct Item
+    {
+        uint64_t id;         // pool offset of the id string
+        uint64_t firstValue; // index into the value array
+        std::array<uint32_t, 3> flags;
+        uint32_t valueCount;
+    };
+    static_assert(std::has_unique_object_representations_v<Item>);
+
+    // FNV-1a: unlike absl::Hash it is not seeded per process.
+    [[nodiscard]] constexpr uint64_t hash(std::string_view s) noexcept
+    {
+        uint64_t h = 0xcbf29ce484222325;
+        for (const char c : s)
+        {
+            h ^= static_cast<uint8_t>(c);
+            h *= 0x100000001b3;
+        }
+        return h;
+    }
+
+    [[nodiscard]] std::string segment_name(std::string_view name, uint64_t generation);
+}
+
+// Read-only view of the newest generation published under a name by SmallCache::publish_shared.
+// Lookups read straight from the mapping; only the returned values are copied out. Safe to share
+// between threads: each lookup pins the mapping it started with, so a concurrent refresh() cannot
+// unmap it underneath.
+class SharedCacheReader
+{
+public:
+    using str = SmallCache::str;
+    using strVec = SmallCache::strVec;
+    using pyAttrValue = SmallCache::pyAttrValue;
+
+    explicit SharedCacheReader(const str& name);
+    ~SharedCacheReader();
+    SharedCacheReader(const SharedCacheReader&) = delete;
+    SharedCacheReader& operator=(const SharedCacheReader&) = delete;
+
+    // Maps the newest published generation if it differs from the current one.
+    bool refresh();
+    [[nodiscard]] uint64_t generation() const noexcept;
+    [[nodiscard]] size_t size() const noexcept;
+    [[nodiscard]] strVec attributes() const;
+
+    std::vector<pyAttrValue> get_one(const str& id, const strVec& attributes);
+    std::vector<std::vector<pyAttrValue>> get_many(const strVec& ids, const strVec& attributes);
+
+private:
+    struct Mapping;
+
+    [[nodiscard]] std::shared_ptr<const Mapping> pinned() const;
+    [[nodiscard]] static const shared_segment::Item* find(const Mapping& mapping, std::string_view id) noexcept;
+    [[nodiscard]] static std::vector<std::optional<uint8_t>> resolve(const Mapping& mapping,
+                                                                     const strVec& attributes);
+    [[nodiscard]] static std::vector<pyAttrValue> project(const Mapping& mapping, const shared_segment::Item* item,
+                                                          const std::vector<std::optional<uint8_t>>& idxs);
+
+    str name;
+    std::unique_ptr<Mapping> control;
+    mutable std::mutex currentMutex; // guards the `current` pointer only, not the mapping it points to
+    std::shared_ptr<const Mapping> current;
+};
@@ -1,20 +1,23 @@
 #include "SmallCache.h"
+#include "Overloaded.h"
+#include "MappedFile.h"
+#include "PageParser.h"
+#include "OrderedIdIndex.h"
+#include "TransactionLog.h"
 #include <print>
 #include <ranges>
 #include <algorithm>
 #include <bit>
+#include <filesystem>
+#include <thread>
+#include <atomic>
 #include <unordered_set>
 
 namespace
 {
-    template <class... Ts>
-    struct overloaded : Ts...
-    {
-        using Ts::operator()...;
-    };
-
-    template <class... Ts>
-    overloaded(Ts...) -> overloaded<Ts...>;
+    // construct the string pool before the list pool, so that it outlives the lists referencing it
+    const SmallCache::fwStr::initializer fw_str_init;
+    const SmallCache::fwStrVec::initializer fw_str_vec_init;
 
     std::string human_readable_size(size_t bytes)
     {
@@ -28,9 +31,41 @@ namespace
         }
         return std::format("{:.2f} {}", v, units[i]);
     }
+
+    // shell-style match supporting '*' and '?'
+    bool wildcard_match(std::string_view pattern, std::string_view name)
+    {
+        size_t p = 0, n = 0, star = std::string_view::npos, mark = 0;
+        while (n < name.size())
+        {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n]))
+            {
+                ++p;
+                ++n;
+            }
+            else if (p < pattern.size() && pattern[p] == '*')
+            {
+                star = p++;
+                mark = n;
+            }
+            else if (star != std::string_view::npos)
+            {
+                p = star + 1;
+                n = ++mark;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*')
+            ++p;
+        return p == pattern.size();
+    }
 }
 
-SmallCache::SmallCache(const strVec& attributes) : numberOfAttributes(attributes.size())
+SmallCache::SmallCache(const strVec& attributes, ParserBackend backend) :
+    numberOfAttributes(attributes.size()), parser(make_page_parser(backend))
 {
     if (attributes.empty())
     {
@@ -50,6 +85,34 @@ SmallCache::SmallCache(const strVec& attributes) : numberOfAttributes(attributes
     }
 }
 
+SmallCache::~SmallCache() = default;
+
+bool SmallCache::parser_backend_available(ParserBackend backend) noexcept
+{
+    return page_parser_available(backend);
+}
+
+ParserBackend SmallCache::parser_backend() const noexcept
+{
+    return parser->backend();
+}
+
+MetricsSnapshot SmallCache::metrics() const
+{
+#ifdef SMALL_CACHE_HAS_METRICS
+    return cacheMetrics.snapshot();
+#else
+    return {};
+#endif
+}
+
+void SmallCache::reset_metrics() noexcept
+{
+#ifdef SMALL_CACHE_HAS_METRICS
+    cacheMetrics.reset();
+#endif
+}
+
 std::vector<size_t> SmallCache::MarkedItem::getIdxs() const
 {
     std::vector<size_t> idxs;
@@ -68,11 +131,8 @@ std::vector<size_t> SmallCache::MarkedItem::getIdxs() const
     return idxs;
 }
 
-std::optional<std::reference_wrapper<SmallCache::AttributeValue>> SmallCache::MarkedItem::getValue(size_t idx) noexcept
+size_t SmallCache::MarkedItem::slotOf(size_t idx) const noexcept
 {
-    if (!hasIdx(idx))
-        return std::nullopt;
-
     // count how many bits are set before 'idx'
     size_t w = idx / 32, b = idx % 32;
     size_t pos = 0;
@@ -88,7 +148,15 @@ std::optional<std::reference_wrapper<SmallCache::AttributeValue>> SmallCache::Ma
         uint32_t mask = (1u << b) - 1;
         pos += std::popcount(attrs_flags[w] & mask);
     }
+    return pos;
+}
 
+std::optional<std::reference_wrapper<SmallCache::AttributeValue>> SmallCache::MarkedItem::getValue(size_t idx) noexcept
+{
+    if (!hasIdx(idx))
+        return std::nullopt;
+
+    const size_t pos = slotOf(idx);
     return value.size() > pos ? std::optional{std::ref(value[pos])} : std::nullopt; // just-in-case
 }
 
@@ -102,93 +170,175 @@ std::optional<std::reference_wrapper<const SmallCache::AttributeValue>> SmallCac
 
 void SmallCache::setMarkedItem(MarkedItem& item, const std::unordered_map<str, pyAttrValue>& attrs)
 {
-    item.isNew = true;
-    item.attrs_flags.fill(0);
-
-    // build a slot for each possible attr index
-    std::vector<std::optional<AttributeValue>> slots(attrMap.size());
-
-    // 1) collect into slots[] by index
+    std::vector<IndexedValue> indexed;
+    indexed.reserve(attrs.size());
     for (auto& [name, pyVal] : attrs)
     {
         if (auto it = attrMap.find(name); it != attrMap.end())
         {
-            slots[it->second] = convert_value(pyVal);
+            indexed.emplace_back(it->second, convert_value(pyVal));
         }
     }
+    setMarkedItem(item, indexed);
+}
+
+void SmallCache::setMarkedItem(MarkedItem& item, std::vector<IndexedValue>& attrs)
+{
+    item.isNew = true;
+    item.attrs_flags.fill(0);
+
+    // 1) order by attr index; stable so that for repeated attributes the last one wins
+    std::ranges::stable_sort(attrs, {}, &IndexedValue::first);
 
     // 2) reserve exactly as many as we’ll push
-    auto count = std::ranges::count_if(slots, [](auto& o) { return o.has_value(); });
     item.value.clear();
-    item.value.reserve(count);
+    item.value.reserve(attrs.size());
 
-    // 3) walk slots in ascending idx order,
+    // 3) walk in ascending idx order,
     //    set flags and move values into item.value
-    for (size_t idx = 0; idx < slots.size(); ++idx)
+    for (size_t i = 0; i < attrs.size(); ++i)
+    {
+        if (i + 1 < attrs.size() && attrs[i + 1].first == attrs[i].first)
+            continue;
+        const auto idx = attrs[i].first;
+        item.value.push_back(std::move(attrs[i].second));
+        auto w = idx / 32;
+        auto b = idx % 32;
+        item.attrs_flags[w] |= (1u << b);
+    }
+}
+
+void SmallCache::patchMarkedItem(MarkedItem& item, uint8_t idx, AttributeValue&& value)
+{
+    const bool present = item.hasIdx(idx);
+    const bool remove = std::holds_alternative<std::monostate>(value);
+    const auto pos = item.value.begin() + static_cast<std::ptrdiff_t>(item.slotOf(idx));
+    if (present && remove)
+    {
+        item.value.erase(pos);
+        item.setIdx(idx, false);
+    }
+    else if (present)
     {
-        if (auto& opt = slots[idx]; opt)
+        *pos = std::move(value);
+    }
+    else if (!remove)
+    {
+        item.value.insert(pos, std::move(value));
+        item.setIdx(idx, true);
+    }
+}
+
+bool SmallCache::stripDroppedAttributes(MarkedItem& item) const
+{
+    bool stripped = false;
+    for (size_t w = 0; w < droppedFlags.size(); ++w)
+    {
+        for (uint32_t bits = item.attrs_flags[w] & droppedFlags[w]; bits != 0; bits &= bits - 1)
         {
-            item.value.push_back(std::move(*opt));
-            auto w = idx / 32;
-            auto b = idx % 32;
-            item.attrs_flags[w] |= (1u << b);
+            const size_t idx = w * 32 + std::countr_zero(bits);
+            item.value.erase(item.value.begin() + static_cast<std::ptrdiff_t>(item.slotOf(idx)));
+            item.setIdx(idx, false);
+            stripped = true;
         }
     }
+    return stripped;
 }
 
-SmallCache::AttributeValue SmallCache::convert_value(const json::AttributeValue& src)
+bool SmallCache::add_attribute(const str& name)
 {
-    return std::visit(overloaded{
-                          [](bool b) -> AttributeValue { return b; },
-                          [](double d) -> AttributeValue { return d; },
-                          [](const str& s) -> AttributeValue
-                          {
-                              // if (s.empty()) return std::monostate{};
-                              return fwStr{s};
-                          },
+    const WriteLock lock(mutex);
+    if (attrMap.contains(name))
+    {
+        return false;
+    }
+    if (freeAttributeIdxs.empty() && attrIdx.size() == MarkedItem::maxAttributes &&
+        std::ranges::any_of(droppedFlags, [](uint32_t w) { return w != 0; }))
+    {
+        compactAttributes();
+    }
 
-                          [](const std::vector<glz::raw_json>& json_vec) -> AttributeValue
-                          {
-                              auto out = std::make_unique<std::vector<fwStr>>();
-                              out->reserve(json_vec.size());
-                              for (auto& r : json_vec)
-                                  if (!r.str.empty())
-                                      out->emplace_back(r.str);
-                              // if (out->empty()) {
-                              //     return std::monostate{};
-                              // }
-                              out->shrink_to_fit();
-                              return out;
-                          },
-                          [](const std::optional<glz::raw_json>& o) -> AttributeValue
-                          {
-                              // if (!o.has_value() || o->str.empty()) return std::monostate{};
-                              return fwStr{o->str};
-                          },
+    uint8_t idx;
+    if (!freeAttributeIdxs.empty())
+    {
+        idx = freeAttributeIdxs.back();
+        freeAttributeIdxs.pop_back();
+        attrIdx[idx] = name;
+    }
+    else if (attrIdx.size() < MarkedItem::maxAttributes)
+    {
+        idx = static_cast<uint8_t>(attrIdx.size());
+        attrIdx.push_back(name);
+        numberOfAttributes = static_cast<uint8_t>(attrIdx.size());
+    }
+    else
+    {
+        throw std::runtime_error("Too many attributes provided");
+    }
+    attrMap.emplace(name, idx);
+    ++schemaGeneration;
+    if (transactionLog)
+    {
+        transactionLog->schema_changed();
+    }
+    return true;
+}
 
-                      },
-                      src);
+bool SmallCache::drop_attribute(const str& name)
+{
+    const WriteLock lock(mutex);
+    const auto it = attrMap.find(name);
+    if (it == attrMap.end())
+    {
+        return false;
+    }
+    const auto idx = it->second;
+    attrMap.erase(it);
+    // a duplicate constructor attribute may still name this index
+    if (std::ranges::none_of(attrMap, [&](const auto& entry) { return entry.second == idx; }))
+    {
+        attrIdx[idx].clear();
+        droppedFlags[idx / 32] |= 1u << (idx % 32);
+    }
+    ++schemaGeneration;
+    if (transactionLog)
+    {
+        transactionLog->schema_changed();
+    }
+    return true;
 }
 
-SmallCache::pyAttrValue SmallCache::convert_valueJ(const json::AttributeValue& src)
+size_t SmallCache::compact_attributes()
 {
-    return std::visit(overloaded{
-                          [](std::monostate b) -> pyAttrValue { return b; },
-                          [](bool b) -> pyAttrValue { return b; },
-                          [](double d) -> pyAttrValue { return d; },
-                          [](const str& s) -> pyAttrValue { return s; },
-                          [](const std::vector<glz::raw_json>& json_vec) -> pyAttrValue
-                          {
-                              return json_vec | std::views::transform([](const glz::raw_json& j) -> str
-                                  {
-                                      return j.str;
-                                  }) |
-                                  std::ranges::to<strVec>();
-                          },
-                          [](const std::optional<glz::raw_json>& o) -> pyAttrValue { return o ? o->str : ""; },
+    const WriteLock lock(mutex);
+    return compactAttributes();
+}
 
-                      },
-                      src);
+size_t SmallCache::compactAttributes()
+{
+    size_t rewritten = 0;
+    for (auto it = cache.begin(); it != cache.end(); ++it)
+    {
+        auto& item = it.value();
+        const size_t before = memoryBudget != 0 ? itemBytes(it->first, item) : 0;
+        if (!stripDroppedAttributes(item))
+        {
+            continue;
+        }
+        item.value.shrink_to_fit();
+        if (memoryBudget != 0)
+        {
+            trackedBytes = trackedBytes - before + itemBytes(it->first, item);
+        }
+        ++rewritten;
+    }
+    for (size_t w = 0; w < droppedFlags.size(); ++w)
+    {
+        for (uint32_t bits = droppedFlags[w]; bits != 0; bits &= bits - 1)
+            freeAttributeIdxs.push_back(static_cast<uint8_t>(w * 32 + std::countr_zero(bits)));
+    }
+    droppedFlags.fill(0);
+    return rewritten;
 }
 
 SmallCache::pyAttrValue SmallCache::convert_value(const AttributeValue& src)
@@ -198,9 +348,9 @@ SmallCache::pyAttrValue SmallCache::convert_value(const AttributeValue& src)
                           [](bool b) -> pyAttrValue { return b; },
                           [](double d) -> pyAttrValue { return d; },
                           [](const fwStr& s) -> pyAttrValue { return s; },
-                          [](const strVecUPtr& fw_vec) -> pyAttrValue
+                          [](const fwStrVec& fw_vec) -> pyAttrValue
                           {
-                              return *fw_vec | std::views::transform([](const fwStr& s) -> str { return s; }) |
+                              return fw_vec.get() | std::views::transform([](const fwStr& s) -> str { return s; }) |
                                   std::ranges::to<strVec>();
                           },
                       },
@@ -216,14 +366,34 @@ SmallCache::AttributeValue SmallCache::convert_value(const pyAttrValue& src)
                           [](const str& s) -> AttributeValue { return fwStr{s}; },
                           [](const strVec& vec) -> AttributeValue
                           {
-                              auto out = std::make_unique<std::vector<fwStr>>();
-                              out->reserve(vec.size());
+                              std::vector<fwStr> out;
+                              out.reserve(vec.size());
                               for (auto& r : vec)
                               {
-                                  out->emplace_back(r);
+                                  out.emplace_back(r);
                               }
-                              out->shrink_to_fit();
-                              return out;
+                              return fwStrVec{std::move(out)};
+                          },
+                      },
+                      src);
+}
+
+SmallCache::AttributeValue SmallCache::convert_value(pyAttrValue&& src)
+{
+    return std::visit(overloaded{
+                          [](std::monostate b) -> AttributeValue { return b; },
+                          [](bool b) -> AttributeValue { return b; },
+                          [](double d) -> AttributeValue { return d; },
+                          [](str& s) -> AttributeValue { return fwStr{std::move(s)}; },
+                          [](strVec& vec) -> AttributeValue
+                          {
+                              std::vector<fwStr> out;
+                              out.reserve(vec.size());
+                              for (auto& r : vec)
+                              {
+                                  out.emplace_back(std::move(r));
+                              }
+                              return fwStrVec{std::move(out)};
                           },
                       },
                       src);
@@ -253,25 +423,400 @@ std::string SmallCache::to_string(const pyAttrValue& src)
                       src);
 }
 
-void SmallCache::add_item(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes)
+void SmallCache::add_item(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes,
+                          double ttl_seconds)
 {
+    const WriteLock lock(mutex);
     if (!transactionOpened)
     {
         throw std::runtime_error("Transaction not opened");
     }
-    auto& marked_attrs = cache[item_id];
-    setMarkedItem(marked_attrs, attributes);
+    SMALL_CACHE_TIME_SCOPE(add_item_ns);
+    SMALL_CACHE_COUNT(items_added, 1);
+    upsertItem(item_id, [&](MarkedItem& item) { setMarkedItem(item, attributes); });
+    if (ttl_seconds > 0)
+    {
+        setTtl(item_id, ttl_seconds);
+    }
+    enforceBudget();
+}
+
+bool SmallCache::set_ttl(const str& item_id, double ttl_seconds)
+{
+    const WriteLock lock(mutex);
+    return setTtl(item_id, ttl_seconds);
+}
+
+bool SmallCache::setTtl(const str& item_id, double ttl_seconds)
+{
+    const auto it = cache.find(item_id);
+    if (it == cache.end())
+    {
+        return false;
+    }
+    if (ttl_seconds <= 0)
+    {
+        if (it->second.hasExpiry)
+        {
+            expiries.erase(item_id);
+            it.value().hasExpiry = false;
+        }
+        return true;
+    }
+    const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(ttl_seconds));
+    expiries.insert_or_assign(item_id, deadline);
+    expiryQueue.emplace(deadline, item_id);
+    it.value().hasExpiry = true;
+    compactExpiryQueue();
+    return true;
+}
+
+void SmallCache::compactExpiryQueue()
+{
+    // stale entries only go away once their deadline passes, so an item refreshed with a long ttl
+    // would otherwise grow the queue without bound; rebuilding at 2x keeps the cost amortised O(1)
+    if (expiryQueue.size() <= 2 * expiries.size() + 64)
+    {
+        return;
+    }
+    std::vector<std::pair<Clock::time_point, str>> live;
+    live.reserve(expiries.size());
+    for (const auto& [id, deadline] : expiries)
+    {
+        live.emplace_back(deadline, id);
+    }
+    expiryQueue = decltype(expiryQueue)(std::greater<>{}, std::move(live));
+}
+
+template <class Fill>
+SmallCache::MarkedItem& SmallCache::upsertItem(const str& id, Fill&& fill)
+{
+    auto [it, inserted] = cache.try_emplace(id);
+    keysGeneration += inserted;
+    auto& item = it.value();
+    if (memoryBudget != 0 && !inserted)
+    {
+        trackedBytes -= itemBytes(it->first, item);
+    }
+    if (item.hasExpiry)
+    {
+        // a replaced item starts without a deadline; add_item sets the new one, if any, afterwards
+        expiries.erase(it->first);
+        item.hasExpiry = false;
+    }
+    fill(item);
+    item.referenced = true;
+    if (memoryBudget != 0)
+    {
+        trackedBytes += itemBytes(it->first, item);
+    }
+    if (transactionLog)
+    {
+        transactionLog->upsert(it->first, item, attrIdx);
+    }
+    return item;
+}
+
+void SmallCache::upsertIndexed(const str& id, std::vector<IndexedValue>& values)
+{
+    upsertItem(id, [&](MarkedItem& item) { setMarkedItem(item, values); });
+}
+
+void SmallCache::reserveItems(size_t count)
+{
+    if (count <= cache.size())
+    {
+        return; // also covers count == 0, so a transaction without an estimate does not rehash
+    }
+    cache.reserve(count);
+    ++keysGeneration; // reserve() rebuilds the table even when the bucket count stays the same
+}
+
+SmallCache::CacheIterator SmallCache::eraseItem(CacheIterator it)
+{
+    if (memoryBudget != 0)
+    {
+        trackedBytes -= itemBytes(it->first, it->second);
+    }
+    if (it->second.hasExpiry)
+    {
+        expiries.erase(it->first);
+    }
+    if (transactionLog)
+    {
+        transactionLog->remove(it->first);
+    }
+    ++keysGeneration;
+    return cache.erase(it);
+}
+
+size_t SmallCache::itemBytes(const str& id, const MarkedItem& item) noexcept
+{
+    // approximate: interned strings and lists are shared between items and not attributed to any of them
+    constexpr size_t sso_capacity = 15;
+    return sizeof(str) + sizeof(MarkedItem) + (id.capacity() > sso_capacity ? id.capacity() + 1 : 0) +
+        item.value.capacity() * sizeof(AttributeValue);
+}
+
+bool SmallCache::isExpired(const str& id, const MarkedItem& item) const
+{
+    if (!item.hasExpiry)
+        return false;
+    const auto it = expiries.find(id);
+    return it != expiries.end() && it->second <= Clock::now();
+}
+
+void SmallCache::enforceBudget()
+{
+    if (!expiryQueue.empty())
+    {
+        sweepExpired(16); // incremental: bounded work per mutation
+    }
+    if (memoryBudget == 0 || trackedBytes <= memoryBudget)
+    {
+        return;
+    }
+    auto it = clockHand.empty() ? cache.end() : cache.find(clockHand);
+    while (trackedBytes > memoryBudget && !cache.empty())
+    {
+        if (it == cache.end())
+        {
+            it = cache.begin();
+        }
+        if (it->second.referenced)
+        {
+            it.value().referenced = false; // second chance
+            ++it;
+        }
+        else
+        {
+            it = eraseItem(it);
+            ++evictionStats.evicted;
+        }
+    }
+    clockHand = it == cache.end() ? str{} : it->first;
+}
+
+void SmallCache::set_memory_budget(size_t max_bytes)
+{
+    const WriteLock lock(mutex);
+    if (memoryBudget == 0 && max_bytes != 0)
+    {
+        trackedBytes = 0;
+        for (const auto& [id, item] : cache)
+        {
+            trackedBytes += itemBytes(id, item);
+        }
+    }
+    memoryBudget = max_bytes;
+    enforceBudget();
+}
+
+size_t SmallCache::sweep_expired(size_t max_items)
+{
+    const WriteLock lock(mutex);
+    return sweepExpired(max_items);
+}
+
+size_t SmallCache::sweepExpired(size_t max_items)
+{
+    const auto now = Clock::now();
+    size_t swept = 0;
+    while (swept < max_items && !expiryQueue.empty() && expiryQueue.top().first <= now)
+    {
+        const auto [deadline, id] = expiryQueue.top();
+        expiryQueue.pop();
+        if (const auto e = expiries.find(id); e == expiries.end() || e->second != deadline)
+        {
+            continue; // the ttl was changed or removed since this entry was queued
+        }
+        if (const auto it = cache.find(id); it != cache.end())
+        {
+            eraseItem(it);
+            ++evictionStats.expired;
+            ++swept;
+        }
+    }
+    return swept;
+}
+
+SmallCache::EvictionStats SmallCache::eviction_stats() const noexcept
+{
+    const ReadLock lock(mutex);
+    auto out = evictionStats;
+    out.memory_budget = memoryBudget;
+    out.tracked_bytes = memoryBudget != 0 ? trackedBytes : 0;
+    out.queued_deadlines = expiryQueue.size();
+    return out;
+}
+
+bool SmallCache::patch_item(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes)
+{
+    const WriteLock lock(mutex);
+    return patchItem(item_id, attributes);
+}
+
+bool SmallCache::patchItem(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes)
+{
+    SMALL_CACHE_TIME_SCOPE(patch_item_ns);
+    return patchWith(item_id, [&](MarkedItem& item, std::vector<uint8_t>& patched)
+    {
+        for (const auto& [name, pyVal] : attributes)
+        {
+            if (const auto attr = attrMap.find(name); attr != attrMap.end())
+            {
+                patchMarkedItem(item, attr->second, convert_value(pyVal));
+                if (transactionLog)
+                {
+                    patched.push_back(attr->second);
+                }
+            }
+        }
+    });
+}
+
+bool SmallCache::patchIndexed(const str& item_id, std::vector<IndexedValue>& values)
+{
+    return patchWith(item_id, [&](MarkedItem& item, std::vector<uint8_t>& patched)
+    {
+        for (auto& [idx, value] : values)
+        {
+            patchMarkedItem(item, idx, std::move(value));
+            if (transactionLog)
+            {
+                patched.push_back(idx);
+            }
+        }
+    });
+}
+
+template <class Apply>
+bool SmallCache::patchWith(const str& item_id, Apply&& apply)
+{
+    const auto it = cache.find(item_id);
+    if (it == cache.end())
+    {
+        return false;
+    }
+    auto& item = it.value();
+    if (memoryBudget != 0)
+    {
+        trackedBytes -= itemBytes(it->first, item);
+    }
+    stripDroppedAttributes(item);
+    std::vector<uint8_t> patched;
+    apply(item, patched);
+    item.referenced = true;
+    if (memoryBudget != 0)
+    {
+        trackedBytes += itemBytes(it->first, item);
+    }
+    if (transactionLog)
+    {
+        transactionLog->patch(it->first, item, patched, attrIdx);
+    }
+    SMALL_CACHE_COUNT(items_patched, 1);
+    enforceBudget();
+    return true;
+}
+
+size_t SmallCache::add_many(const strVec& ids, const strVec& attributes, std::vector<std::vector<pyAttrValue>>&& rows)
+{
+    if (rows.size() != ids.size())
+    {
+        throw std::runtime_error(std::format("add_many got {} rows for {} ids", rows.size(), ids.size()));
+    }
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        if (rows[i].size() != attributes.size())
+        {
+            throw std::runtime_error(std::format("add_many row {} has {} values for {} attributes", i,
+                                                 rows[i].size(), attributes.size()));
+        }
+    }
+    return addMany(ids, attributes, [&](size_t i) { return rows[i].data(); });
+}
+
+size_t SmallCache::add_many_flat(const strVec& ids, const strVec& attributes, std::vector<pyAttrValue>&& values)
+{
+    if (values.size() != ids.size() * attributes.size())
+    {
+        throw std::runtime_error(std::format("add_many got {} values for {} ids and {} attributes", values.size(),
+                                             ids.size(), attributes.size()));
+    }
+    return addMany(ids, attributes, [&](size_t i) { return values.data() + i * attributes.size(); });
+}
+
+template <class RowAt>
+size_t SmallCache::addMany(const strVec& ids, const strVec& attributes, RowAt&& rowAt)
+{
+    const WriteLock lock(mutex);
+    if (!transactionOpened)
+    {
+        throw std::runtime_error("Transaction not opened");
+    }
+    SMALL_CACHE_TIME_SCOPE(add_many_ns);
+    const auto idxs = resolveAttributes(attributes);
+    std::vector<IndexedValue> indexed;
+    indexed.reserve(attributes.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        pyAttrValue* row = rowAt(i);
+        indexed.clear();
+        for (size_t a = 0; a < attributes.size(); ++a)
+        {
+            if (idxs[a] && !std::holds_alternative<std::monostate>(row[a]))
+            {
+                indexed.emplace_back(*idxs[a], convert_value(std::move(row[a])));
+            }
+        }
+        upsertItem(ids[i], [&](MarkedItem& item) { setMarkedItem(item, indexed); });
+    }
+    SMALL_CACHE_COUNT(items_added, ids.size());
+    enforceBudget();
+    return ids.size();
+}
+
+size_t SmallCache::patch_many(const std::unordered_map<str, std::unordered_map<str, pyAttrValue>>& patches)
+{
+    const WriteLock lock(mutex);
+    size_t patched = 0;
+    for (const auto& [item_id, attributes] : patches)
+    {
+        patched += patchItem(item_id, attributes);
+    }
+    return patched;
 }
 
 std::vector<SmallCache::pyAttrValue> SmallCache::get_one(const str& id, const strVec& attributes)
+{
+    SMALL_CACHE_READ_TIME_SCOPE(get_one_ns);
+    const ReadLock lock(mutex);
+    return lookup(id, attributes);
+}
+
+void SmallCache::markReferenced(MarkedItem& item) noexcept
+{
+    // several readers may set it at once; writers hold the lock exclusively, so plain access is fine there
+    const std::atomic_ref referenced(item.referenced);
+    if (!referenced.load(std::memory_order_relaxed))
+    {
+        referenced.store(true, std::memory_order_relaxed);
+    }
+}
+
+std::vector<SmallCache::pyAttrValue> SmallCache::lookup(const str& id, const strVec& attributes)
 {
     if (attributes.empty())
     {
         return {};
     }
-    if (cache.contains(id))
+    if (const auto it = cache.find(id); it != cache.end() && !isExpired(it->first, it->second))
     {
-        const auto& item = cache.at(id);
+        SMALL_CACHE_READ_COUNT(get_one_hits, 1);
+        auto& item = it.value();
+        markReferenced(item);
         return attributes | std::views::transform([this, &item](const auto& attr_name) -> pyAttrValue
             {
                 if (!attrMap.contains(attr_name))
@@ -285,47 +830,261 @@ std::vector<SmallCache::pyAttrValue> SmallCache::get_one(const str& id, const st
             }) |
             std::ranges::to<std::vector<pyAttrValue>>();
     }
+    SMALL_CACHE_READ_COUNT(get_one_misses, 1);
     return {};
 }
 
 std::vector<std::vector<SmallCache::pyAttrValue>> SmallCache::get_many(const strVec& ids, const strVec& attributes)
 {
+    SMALL_CACHE_READ_TIME_SCOPE(get_many_ns);
+    SMALL_CACHE_READ_RECORD(get_many_batch_size, ids.size());
     std::vector<std::vector<pyAttrValue>> out;
     out.resize(ids.size());
+    const ReadLock lock(mutex);
     for (size_t i = 0; i < ids.size(); ++i)
     {
-        out[i] = get_one(ids[i], attributes);
+        out[i] = lookup(ids[i], attributes);
     }
     return out;
 }
 
+SmallCache::ColumnarResult SmallCache::get_many_columnar(const strVec& ids, const strVec& attributes)
+{
+    SMALL_CACHE_READ_TIME_SCOPE(get_many_ns);
+    SMALL_CACHE_READ_RECORD(get_many_batch_size, ids.size());
+    ColumnarResult out;
+    out.found.reserve(ids.size());
+    out.columns.resize(attributes.size());
+
+    const ReadLock lock(mutex);
+    // resolve attribute names once, under the lock since add/drop_attribute rehash attrMap;
+    // unknown names give all-invalid columns
+    const auto idxs = resolveAttributes(attributes);
+    for (auto& column : out.columns)
+    {
+        column.valid.reserve(ids.size());
+    }
+
+    for (const auto& id : ids)
+    {
+        const auto it = cache.find(id);
+        const bool found = it != cache.end() && !isExpired(it->first, it->second);
+        out.found.push_back(found);
+        if (found)
+        {
+            SMALL_CACHE_READ_COUNT(get_one_hits, 1);
+            markReferenced(it.value());
+        }
+        else
+        {
+            SMALL_CACHE_READ_COUNT(get_one_misses, 1);
+        }
+        for (size_t a = 0; a < attributes.size(); ++a)
+        {
+            const AttributeValue* value = nullptr;
+            if (found && idxs[a])
+            {
+                if (const auto ref = it->second.getValue(*idxs[a]))
+                    value = &ref->get();
+            }
+            appendCell(out.columns[a], value);
+        }
+    }
+    return out;
+}
+
+std::vector<std::optional<uint8_t>> SmallCache::resolveAttributes(const strVec& attributes) const
+{
+    std::vector<std::optional<uint8_t>> idxs;
+    idxs.reserve(attributes.size());
+    for (const auto& name : attributes)
+    {
+        const auto it = attrMap.find(name);
+        idxs.push_back(it != attrMap.end() ? std::optional{it->second} : std::nullopt);
+    }
+    return idxs;
+}
+
+std::vector<SmallCache::pyAttrValue> SmallCache::project(const MarkedItem& item,
+                                                         const std::vector<std::optional<uint8_t>>& idxs)
+{
+    std::vector<pyAttrValue> row;
+    row.reserve(idxs.size());
+    for (const auto& idx : idxs)
+    {
+        const auto value = idx ? item.getValue(*idx) : std::nullopt;
+        row.push_back(value ? convert_value(*value) : pyAttrValue{});
+    }
+    return row;
+}
+
+void SmallCache::appendCell(Column& column, const AttributeValue* value)
+{
+    using Kind = Column::Kind;
+    const auto row = column.valid.size();
+    if (value && std::holds_alternative<std::monostate>(*value))
+    {
+        value = nullptr;
+    }
+
+    if (value)
+    {
+        const Kind kind = std::holds_alternative<double>(*value) ? Kind::Double
+            : std::holds_alternative<bool>(*value) ? Kind::Bool
+            : std::holds_alternative<fwStr>(*value) ? Kind::String
+            : Kind::Object;
+        if (column.kind == Kind::Empty)
+        {
+            // first value decides the type; backfill the missing rows seen so far
+            column.kind = kind;
+            column.doubles.assign(kind == Kind::Double ? row : 0, std::numeric_limits<double>::quiet_NaN());
+            column.bools.assign(kind == Kind::Bool ? row : 0, 0);
+            column.strings.assign(kind == Kind::String ? row : 0, std::nullopt);
+            column.objects.assign(kind == Kind::Object ? row : 0, pyAttrValue{});
+        }
+        else if (column.kind != kind && column.kind != Kind::Object)
+        {
+            // mixed types: convert what we have so far to objects
+            std::vector<pyAttrValue> objects(row);
+            for (size_t i = 0; i < row; ++i)
+            {
+                if (!column.valid[i])
+                    continue;
+                switch (column.kind)
+                {
+                case Kind::Double: objects[i] = column.doubles[i];
+                    break;
+                case Kind::Bool: objects[i] = column.bools[i] != 0;
+                    break;
+                case Kind::String: objects[i] = column.strings[i]->get();
+                    break;
+                default: break;
+                }
+            }
+            column = Column{.kind = Kind::Object, .valid = std::move(column.valid), .objects = std::move(objects)};
+        }
+    }
+
+    column.valid.push_back(value != nullptr);
+    switch (column.kind)
+    {
+    case Kind::Empty:
+        break;
+    case Kind::Double:
+        column.doubles.push_back(value ? std::get<double>(*value) : std::numeric_limits<double>::quiet_NaN());
+        break;
+    case Kind::Bool:
+        column.bools.push_back(value ? std::get<bool>(*value) : 0);
+        break;
+    case Kind::String:
+        column.strings.push_back(value ? std::optional{std::get<fwStr>(*value)} : std::nullopt);
+        break;
+    case Kind::Object:
+        column.objects.push_back(value ? convert_value(*value) : pyAttrValue{});
+        break;
+    }
+}
+
 std::vector<std::string> SmallCache::get_all_ids()
 {
-    std::vector<str> keys = cache | std::views::keys | std::ranges::to<std::vector>();
+    const ReadLock lock(mutex);
+    if (expiries.empty())
+    {
+        std::vector<str> keys = cache | std::views::keys | std::ranges::to<std::vector>();
+        return keys;
+    }
+    std::vector<str> keys;
+    keys.reserve(cache.size());
+    for (const auto& [id, item] : cache)
+    {
+        if (!isExpired(id, item))
+            keys.push_back(id);
+    }
     return keys;
 }
 
+SmallCache::IdCursor::IdCursor(const SmallCache& owner, size_t chunk_size) :
+    owner(owner), position(owner.cache.cbegin()), generation(owner.keysGeneration), chunkSize(chunk_size)
+{
+    if (chunk_size == 0)
+    {
+        throw std::runtime_error("Chunk size must be positive");
+    }
+}
+
+std::vector<std::string> SmallCache::IdCursor::next_chunk()
+{
+    const ReadLock lock(owner.mutex);
+    if (generation != owner.keysGeneration)
+    {
+        throw std::runtime_error("Cache was modified during id iteration");
+    }
+    std::vector<str> ids;
+    ids.reserve(std::min(chunkSize, owner.cache.size()));
+    for (; position != owner.cache.cend() && ids.size() < chunkSize; ++position)
+    {
+        if (!owner.isExpired(position->first, position->second))
+            ids.push_back(position->first);
+    }
+    return ids;
+}
+
+bool SmallCache::IdCursor::exhausted() const noexcept
+{
+    const ReadLock lock(owner.mutex);
+    return generation != owner.keysGeneration || position == owner.cache.cend();
+}
+
+SmallCache::IdCursor SmallCache::id_cursor(size_t chunk_size) const
+{
+    const ReadLock lock(mutex);
+    return IdCursor(*this, chunk_size);
+}
+
+size_t SmallCache::ids_count() const
+{
+    const ReadLock lock(mutex);
+    const auto now = Clock::now();
+    const auto expired = std::ranges::count_if(expiries, [&](const auto& entry) { return entry.second <= now; });
+    return cache.size() - static_cast<size_t>(expired);
+}
+
 void SmallCache::begin_transaction(uint64_t estimated_number_of_items, bool remove_old_items)
+{
+    const WriteLock lock(mutex);
+    beginTransaction(estimated_number_of_items, remove_old_items);
+}
+
+void SmallCache::beginTransaction(uint64_t estimated_number_of_items, bool remove_old_items)
 {
     if (transactionOpened)
     {
         throw std::runtime_error("Transaction already open");
     }
-    if (estimated_number_of_items != 0)
-    {
-        cache.reserve(estimated_number_of_items);
-    }
+    reserveItems(estimated_number_of_items);
+    SMALL_CACHE_COUNT(transactions, 1);
     oldCacheSize = cache.size();
     transactionOpened = true;
     transactionShouldRemoveOldItems = remove_old_items;
+    if (transactionLog)
+    {
+        transactionLog->begin(estimated_number_of_items);
+    }
 }
 
 void SmallCache::end_transaction()
+{
+    const WriteLock lock(mutex);
+    endTransaction();
+}
+
+void SmallCache::endTransaction()
 {
     if (!transactionOpened)
     {
         throw std::runtime_error("Transaction not opened");
     }
+    SMALL_CACHE_TIME_SCOPE(end_transaction_ns);
     for (auto it = cache.begin(); it != cache.end();)
     {
         if (it->second.isNew)
@@ -337,7 +1096,7 @@ void SmallCache::end_transaction()
         {
             if (transactionShouldRemoveOldItems)
             {
-                it = cache.erase(it);
+                it = eraseItem(it);
             }
             else
             {
@@ -347,32 +1106,230 @@ void SmallCache::end_transaction()
     }
     transactionOpened = false;
     transactionShouldRemoveOldItems = true;
+    if (transactionLog)
+    {
+        transactionLog->end();
+    }
+    if (orderedIndex)
+    {
+        rebuildOrderedIndex();
+    }
 }
 
-size_t SmallCache::load_page(const str& json_text)
+void SmallCache::set_ordered_index(bool enabled)
 {
+    const WriteLock lock(mutex);
+    if (!enabled)
+    {
+        orderedIndex.reset();
+        return;
+    }
+    if (!orderedIndex)
+    {
+        rebuildOrderedIndex();
+    }
+}
+
+bool SmallCache::has_ordered_index() const noexcept
+{
+    const ReadLock lock(mutex);
+    return orderedIndex != nullptr;
+}
+
+void SmallCache::rebuildOrderedIndex()
+{
+    std::vector<std::string_view> keys;
+    keys.reserve(cache.size());
+    for (const auto& [id, item] : cache)
+    {
+        keys.emplace_back(id);
+    }
+    orderedIndex = std::make_unique<OrderedIdIndex>(std::move(keys));
+}
+
+size_t SmallCache::load_page(std::string_view json_text)
+{
+    return loadPage(json_text, json_text.size());
+}
+
+size_t SmallCache::loadPage(std::string_view json_text, size_t readable)
+{
+    // parse under the shared lock so that readers are only held up while the items are inserted
+    ParsedPage page;
+    uint64_t schema;
+    {
+        const ReadLock lock(mutex);
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+        schema = schemaGeneration;
+        SMALL_CACHE_TIME_SCOPE(load_page_parse_ns);
+        page = parser->parse(json_text, readable, attrMap);
+    }
+    const WriteLock lock(mutex);
     if (!transactionOpened)
     {
         throw std::runtime_error("Transaction not opened");
     }
-    json::Response resp;
-    if (auto ce = glz::read<glz::opts{.error_on_unknown_keys = false}>(resp, json_text))
-        throw std::runtime_error(glz::format_error(ce, json_text));
-    cache.reserve(resp.result.count);
-    for (auto& item : resp.result.data)
+    if (schemaGeneration != schema)
     {
-        auto& marked_item = cache[item.id];
-        std::unordered_map<str, pyAttrValue> attrs;
-        for (auto& attr : item.attributes)
-            attrs[attr.id] = convert_valueJ(attr.value);
+        page = parser->parse(json_text, readable, attrMap); // attribute indices changed in between
+    }
+    SMALL_CACHE_TIME_SCOPE(load_page_insert_ns);
+    SMALL_CACHE_COUNT(pages_loaded, 1);
+    return insert_page(page);
+}
 
-        setMarkedItem(marked_item, attrs);
+size_t SmallCache::load_pages(std::string_view json_stream)
+{
+    {
+        const ReadLock lock(mutex);
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+    }
+    const auto documents = split_json_documents(json_stream);
+    const auto* end = json_stream.data() + json_stream.size();
+    for (const auto document : documents)
+    {
+        // the rest of the stream is readable past each document
+        loadPage(document, static_cast<size_t>(end - document.data()));
+    }
+    return documents.size();
+}
+
+std::vector<SmallCache::ParsedPage> SmallCache::parse_file(const str& path) const
+{
+    const MappedFile file(path);
+    const auto documents = split_json_documents(file.view());
+    std::vector<ParsedPage> pages;
+    pages.reserve(documents.size());
+    for (const auto document : documents)
+    {
+        SMALL_CACHE_TIME_SCOPE(load_page_parse_ns);
+        const auto offset = static_cast<size_t>(document.data() - file.view().data());
+        pages.push_back(parser->parse(document, file.readable() - offset, attrMap));
     }
-    return resp.result.pagination.pages;
+    return pages;
+}
+
+size_t SmallCache::load_file(const str& path)
+{
+    std::vector<ParsedPage> pages;
+    uint64_t schema;
+    {
+        const ReadLock lock(mutex);
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+        schema = schemaGeneration;
+        pages = parse_file(path);
+    }
+    const WriteLock lock(mutex);
+    if (!transactionOpened)
+    {
+        throw std::runtime_error("Transaction not opened");
+    }
+    if (schemaGeneration != schema)
+    {
+        pages = parse_file(path);
+    }
+    for (auto& page : pages)
+    {
+        SMALL_CACHE_TIME_SCOPE(load_page_insert_ns);
+        SMALL_CACHE_COUNT(pages_loaded, 1);
+        insert_page(page);
+    }
+    return pages.size();
+}
+
+size_t SmallCache::load_directory(const str& path, const str& pattern, size_t threads)
+{
+    {
+        const ReadLock lock(mutex);
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+    }
+    std::vector<str> files;
+    for (const auto& entry : std::filesystem::directory_iterator(path))
+    {
+        if (entry.is_regular_file() && wildcard_match(pattern, entry.path().filename().string()))
+            files.push_back(entry.path().string());
+    }
+    std::ranges::sort(files);
+
+    // Files are parsed in batches of `threads` in parallel (parsing only reads attrMap) under the
+    // shared lock, then inserted on this thread in file order, so the outcome matches a sequential replay.
+    threads = std::max<size_t>(threads, 1);
+    size_t loaded = 0;
+    for (size_t first = 0; first < files.size(); first += threads)
+    {
+        const size_t batch = std::min(threads, files.size() - first);
+        std::vector<std::vector<ParsedPage>> parsed(batch);
+        std::vector<std::exception_ptr> errors(batch);
+        uint64_t schema;
+        {
+            const ReadLock lock(mutex);
+            schema = schemaGeneration;
+            std::vector<std::jthread> workers;
+            workers.reserve(batch - 1);
+            const auto work = [&](size_t i)
+            {
+                try
+                {
+                    parsed[i] = parse_file(files[first + i]);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            };
+            for (size_t i = 1; i < batch; ++i)
+                workers.emplace_back(work, i);
+            work(0);
+        }
+        const WriteLock lock(mutex);
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+        for (size_t i = 0; i < batch; ++i)
+        {
+            if (errors[i])
+                std::rethrow_exception(errors[i]);
+            if (schemaGeneration != schema)
+                parsed[i] = parse_file(files[first + i]);
+            for (auto& page : parsed[i])
+            {
+                SMALL_CACHE_TIME_SCOPE(load_page_insert_ns);
+                SMALL_CACHE_COUNT(pages_loaded, 1);
+                insert_page(page);
+            }
+            loaded += parsed[i].size();
+        }
+    }
+    return loaded;
+}
+
+size_t SmallCache::insert_page(ParsedPage& page)
+{
+    reserveItems(page.count);
+    for (auto& item : page.items)
+    {
+        upsertItem(item.id, [&](MarkedItem& marked) { setMarkedItem(marked, item.attrs); });
+    }
+    enforceBudget();
+    return page.pages;
 }
 
 void SmallCache::print_variant_stats() const
 {
+    const ReadLock lock(mutex);
     struct CountBytes
     {
         size_t count = 0;
@@ -385,6 +1342,7 @@ void SmallCache::print_variant_stats() const
 
     std::unordered_set<std::string> unique_strings;
     unique_strings.reserve(65536);
+    std::unordered_set<const std::vector<fwStr>*> unique_lists;
 
     // collect counts and heap-only bytes for vector payloads and interned strings
     for (const auto& kv : cache)
@@ -411,14 +1369,17 @@ void SmallCache::print_variant_stats() const
                                ++s_fw.count;
                                unique_strings.emplace(static_cast<const std::string&>(fws));
                            },
-                           [&](const strVecUPtr& vecptr)
+                           [&](const fwStrVec& fw_vec)
                            {
                                ++s_vec.count;
-                               if (vecptr)
+                               // lists are hash-consed, so only the first handle to a list pays for its heap
+                               const auto& vec = fw_vec.get();
+                               if (unique_lists.insert(&vec).second)
                                {
-                                   s_vec.heap_bytes += sizeof(std::vector<fwStr>);
-                                   s_vec.heap_bytes += vecptr->capacity() * sizeof(fwStr);
-                                   for (const auto& fws : *vecptr)
+                                   constexpr size_t intern_node_overhead = 32;
+                                   s_vec.heap_bytes += sizeof(std::vector<fwStr>) + intern_node_overhead;
+                                   s_vec.heap_bytes += vec.capacity() * sizeof(fwStr);
+                                   for (const auto& fws : vec)
                                    {
                                        unique_strings.emplace(static_cast<const std::string&>(fws));
                                    }
@@ -463,18 +1424,23 @@ void SmallCache::print_variant_stats() const
     std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
                  "fwStr (handles)", s_fw.count, slot_bytes(s_fw.count), 0ULL, human_line(slot_bytes(s_fw.count), 0));
     std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
-                 "vector<fwStr> (heap)", s_vec.count, slot_bytes(s_vec.count), s_vec.heap_bytes,
-                 human_line(slot_bytes(s_vec.count), s_vec.heap_bytes));
+                 "fwStrVec (handles)", s_vec.count, slot_bytes(s_vec.count), 0ULL,
+                 human_line(slot_bytes(s_vec.count), 0));
     std::println("{:-<94}", "");
     std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
                  "unique interned strings", unique_strings.size(), 0ULL, unique_strings_heap,
                  human_line(0, unique_strings_heap));
+    std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
+                 "unique interned lists", unique_lists.size(), 0ULL, s_vec.heap_bytes,
+                 human_line(0, s_vec.heap_bytes));
+    std::println("{:<34}{:>12.2f}", "list dedup ratio (handles/unique)",
+                 unique_lists.empty() ? 0.0 : static_cast<double>(s_vec.count) / unique_lists.size());
     std::println("{:=<94}", "");
     std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
                  "variant storage (slots)", total_values, total_slot_bytes, 0ULL,
                  human_readable_size(total_slot_bytes));
     std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
-                 "heap only (vectors + intern pool)", "", 0ULL, total_heap_bytes,
+                 "heap only (intern pools)", "", 0ULL, total_heap_bytes,
                  human_readable_size(total_heap_bytes));
     std::println("{:<34}{:>12}{:>16}{:>16}{:>16}",
                  "TOTAL (approx)", "", total_slot_bytes, total_heap_bytes, human_readable_size(grand_total));
@@ -5,7 +5,10 @@
 #include <boost/flyweight.hpp>
 #include <glaze/glaze.hpp>
 #include <tsl/sparse_map.h>
+#include "Metrics.h"
+#include "StripedSharedMutex.h"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 #include <optional>
@@ -13,6 +16,10 @@
 #include <array>
 #include <bit>
 #include <unordered_map>
+#include <chrono>
+#include <queue>
+#include <mutex>
+#include <shared_mutex>
 
 namespace json
 {
@@ -50,24 +57,164 @@ namespace json
     };
 } // namespace json
 
+enum class ParserBackend : uint8_t
+{
+    Glaze,
+    Simdjson,
+};
+
+class PageParser;
+class OrderedIdIndex;
+
+namespace transaction_log
+{
+    class Writer;
+    class Reader;
+}
+
+// Thread-safe: reads (get_one, get_many, scans, aggregates) run concurrently under a shared lock,
+// mutations take it exclusively. load_page and friends parse under the shared lock and only hold
+// the exclusive one while inserting.
 class SmallCache
 {
 public:
     using str = std::string;
     using strVec = std::vector<str>;
     using fwStr = boost::flyweight<str>;
-    using strVecUPtr = std::unique_ptr<std::vector<fwStr>>;
+    // hash-consed string lists: identical lists share one interned, reference-counted vector
+    using fwStrVec = boost::flyweight<std::vector<fwStr>>;
 
-    using AttributeValue = std::variant<std::monostate, double, bool, fwStr, strVecUPtr>;
+    using AttributeValue = std::variant<std::monostate, double, bool, fwStr, fwStrVec>;
     using pyAttrValue = std::variant<std::monostate, bool, double, str, strVec>;
+    using AttrMap = absl::flat_hash_map<str, uint8_t>;
+    using IndexedValue = std::pair<uint8_t, AttributeValue>;
+
+    // Items produced by a PageParser, with attribute names already resolved to indices.
+    struct ParsedItem
+    {
+        str id;
+        std::vector<IndexedValue> attrs;
+    };
 
-    explicit SmallCache(const strVec& attributes);
+    struct ParsedPage
+    {
+        size_t count = 0;
+        size_t pages = 0;
+        std::vector<ParsedItem> items;
+    };
+
+    explicit SmallCache(const strVec& attributes, ParserBackend backend = default_parser_backend());
     SmallCache(const SmallCache&) = delete;
     SmallCache& operator=(const SmallCache&) = delete;
+    ~SmallCache();
+
+    static constexpr ParserBackend default_parser_backend() noexcept
+    {
+#ifdef SMALL_CACHE_HAS_SIMDJSON
+        return ParserBackend::Simdjson;
+#else
+        return ParserBackend::Glaze;
+#endif
+    }
+
+    static bool parser_backend_available(ParserBackend backend) noexcept;
+
+    using Clock = std::chrono::steady_clock;
+
+    struct EvictionStats
+    {
+        size_t memory_budget = 0;
+        size_t tracked_bytes = 0;
+        uint64_t evicted = 0;
+        uint64_t expired = 0;
+        size_t queued_deadlines = 0; // TTL queue entries, including stale ones awaiting their deadline
+    };
+
+    // One attribute of a get_many_columnar result. Cells where the item or the attribute is missing have
+    // valid[i] == 0. The kind follows the first value seen; a column holding several types, or string
+    // lists, falls back to Object.
+    struct Column
+    {
+        enum class Kind : uint8_t
+        {
+            Empty,
+            Double,
+            Bool,
+            String,
+            Object,
+        };
+
+        Kind kind = Kind::Empty;
+        std::vector<uint8_t> valid;
+        std::vector<double> doubles; // NaN where not valid
+        std::vector<uint8_t> bools;
+        std::vector<std::optional<fwStr>> strings;
+        std::vector<pyAttrValue> objects;
+    };
+
+    struct ColumnarResult
+    {
+        std::vector<uint8_t> found;
+        std::vector<Column> columns;
+    };
+
+    // Predicate for scan(). Eq/Ne/Lt/Gt compare `attribute` with values[0], In with any of `values`,
+    // Contains tests whether the string-list attribute holds values[0], Has tests presence.
+    // And/Or combine `children`. Ne is the negation of Eq, so it also matches items without the attribute.
+    struct Filter
+    {
+        enum class Op : uint8_t
+        {
+            Eq,
+            Ne,
+            Lt,
+            Gt,
+            In,
+            Contains,
+            Has,
+            And,
+            Or,
+        };
+
+        Op op = Op::And;
+        str attribute;
+        std::vector<pyAttrValue> values;
+        std::vector<Filter> children;
+    };
+
+    using Row = std::pair<str, std::vector<pyAttrValue>>;
+
+    // Metric for aggregate(). Count without an attribute counts items, with one it counts items having
+    // it; Sum/Min/Max only see numeric values; CountDistinct counts distinct values of the attribute.
+    struct Metric
+    {
+        enum class Kind : uint8_t
+        {
+            Count,
+            Sum,
+            Min,
+            Max,
+            CountDistinct,
+        };
+
+        Kind kind = Kind::Count;
+        str attribute;
+
+        // "count", "count(attr)", "sum(attr)", "min(attr)", "max(attr)" or "count_distinct(attr)"
+        static Metric parse(std::string_view spec);
+    };
+
+    struct AggregateRow
+    {
+        std::vector<pyAttrValue> key;              // one per group-by attribute
+        std::vector<std::optional<double>> values; // one per metric, empty for Min/Max without values
+    };
 
     struct MarkedItem
     {
         bool isNew = true;
+        bool referenced = true; // CLOCK bit, set on every read, cleared by the eviction hand
+        bool hasExpiry = false; // an entry in SmallCache::expiries exists for this item
         std::array<uint32_t, 3> attrs_flags{}; // 96 bits total
         static constexpr std::size_t maxAttributes =
             std::tuple_size_v<decltype(attrs_flags)> *
@@ -85,34 +232,198 @@ public:
             return (attrs_flags[w] >> b) & 1u;
         }
 
+        // position in `value` of attribute idx (or where it would be inserted)
+        [[nodiscard]] size_t slotOf(size_t idx) const noexcept;
+        void setIdx(size_t idx, bool present) noexcept
+        {
+            if (present)
+                attrs_flags[idx / 32] |= 1u << (idx % 32);
+            else
+                attrs_flags[idx / 32] &= ~(1u << (idx % 32));
+        }
+
         [[nodiscard]] std::optional<std::reference_wrapper<AttributeValue>> getValue(size_t idx) noexcept;
         [[nodiscard]] std::optional<std::reference_wrapper<const AttributeValue>> getValue(size_t idx) const noexcept;
     };
 
-    void add_item(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes);
+    // Walks the ids in map order a chunk at a time instead of copying the whole key set. Reads do not
+    // disturb it; any insert or erase in the cache invalidates it and the next next_chunk() throws.
+    class IdCursor
+    {
+    public:
+        // expects the owner's lock to be held; use SmallCache::id_cursor()
+        IdCursor(const SmallCache& owner, size_t chunk_size);
+
+        // Up to chunk_size ids, empty once every id has been returned.
+        std::vector<str> next_chunk();
+        [[nodiscard]] bool exhausted() const noexcept;
+
+    private:
+        const SmallCache& owner;
+        tsl::sparse_map<str, MarkedItem>::const_iterator position;
+        uint64_t generation;
+        size_t chunkSize;
+    };
+
+    // Replacing an item (add_item, add_many, load_page, apply_log) also replaces its TTL: the item
+    // expires after ttl_seconds if it is positive and never otherwise. patch_item keeps the TTL.
+    void add_item(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes,
+                  double ttl_seconds = 0);
+    bool set_ttl(const str& item_id, double ttl_seconds);
+    // Batched add_item: rows[i][a] is the value of attributes[a] for ids[i], monostate when absent.
+    // Attribute names are resolved once for the whole batch. The batch is validated before any item
+    // is written, so a malformed one leaves the cache untouched.
+    size_t add_many(const strVec& ids, const strVec& attributes, std::vector<std::vector<pyAttrValue>>&& rows);
+    // add_many over one row-major buffer: values[i * attributes.size() + a].
+    size_t add_many_flat(const strVec& ids, const strVec& attributes, std::vector<pyAttrValue>&& values);
+    bool patch_item(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes);
+    size_t patch_many(const std::unordered_map<str, std::unordered_map<str, pyAttrValue>>& patches);
     std::vector<pyAttrValue> get_one(const str& id, const strVec& attributes);
     std::vector<std::vector<pyAttrValue>> get_many(const strVec& ids, const strVec& attributes);
+    ColumnarResult get_many_columnar(const strVec& ids, const strVec& attributes);
+    std::vector<Row> scan(const Filter& filter, const strVec& attributes, size_t limit = 0,
+                          size_t threads = 0) const;
+    // Ordered id index: a sorted, prefix-compressed copy of the ids rebuilt at end_transaction, so
+    // that prefix_scan/range_scan do not visit the whole cache. Items changed by an open
+    // transaction become visible to these scans once it ends.
+    void set_ordered_index(bool enabled);
+    [[nodiscard]] bool has_ordered_index() const noexcept;
+    std::vector<Row> prefix_scan(const str& prefix, const strVec& attributes, size_t limit = 0) const;
+    std::vector<Row> range_scan(const str& lo, const std::optional<str>& hi, const strVec& attributes,
+                                size_t limit = 0) const;
+    // Writes a snapshot into the shared-memory object "<name>.<generation>" and makes it the one
+    // SharedCacheReader(name) instances see; returns the generation readers now see. Safe to call
+    // from several threads or processes at once: each publish gets its own generation, and one
+    // that is overtaken by a newer publish is discarded. See SharedSegment.h.
+    uint64_t publish_shared(const str& name) const;
+    static void remove_shared(const str& name);
+    // Transaction log: records every transaction, and every patch or removal made outside one, as a
+    // compact binary delta that apply_log() replays into another cache without parsing JSON (see
+    // TransactionLog.h). With an empty path complete frames stay in memory for take_transaction_log(),
+    // otherwise each is appended to the file or pipe at `path`. TTLs are not recorded. Once more than
+    // `max_buffered` bytes of frames wait in memory they are dropped, as are later ones until the
+    // next take_transaction_log(), which throws: replicas fed from this log have to be rebuilt.
+    void enable_transaction_log(const str& path = {}, size_t max_buffered = size_t{64} << 20);
+    void disable_transaction_log();
+    std::string take_transaction_log();
+    // Replays a log; returns the number of frames (transactions or standalone patches/removals) applied.
+    // A frame cut short by malformed input stays applied up to the bad record, and the exception propagates.
+    size_t apply_log(std::string_view log);
+    // Files are mapped; anything else, such as a pipe, is replayed frame by frame as frames arrive.
+    size_t apply_log_file(const str& path);
+    std::vector<AggregateRow> aggregate(const strVec& group_by, const std::vector<Metric>& metrics,
+                                        size_t threads = 0) const;
+    // Schema changes. A new attribute is absent from every existing item, so adding is O(1). Dropping
+    // only hides the attribute; items lose its value on their next full rewrite or patch, or in
+    // compact_attributes(), after which the index can be handed out again.
+    bool add_attribute(const str& name);
+    bool drop_attribute(const str& name);
+    size_t compact_attributes();
     std::vector<str> get_all_ids();
+    [[nodiscard]] IdCursor id_cursor(size_t chunk_size = 65536) const;
+    [[nodiscard]] size_t ids_count() const;
     void begin_transaction(uint64_t estimated_number_of_items = 0, bool remove_old_items = true);
     void end_transaction();
-    size_t load_page(const str& json_text);
+    size_t load_page(std::string_view json_text);
+    size_t load_pages(std::string_view json_stream);
+    size_t load_file(const str& path);
+    size_t load_directory(const str& path, const str& pattern = "*.json", size_t threads = 1);
+    void set_memory_budget(size_t max_bytes);
+    size_t sweep_expired(size_t max_items = std::numeric_limits<size_t>::max());
+    [[nodiscard]] EvictionStats eviction_stats() const noexcept;
+    [[nodiscard]] ParserBackend parser_backend() const noexcept;
+    [[nodiscard]] MetricsSnapshot metrics() const;
+    void reset_metrics() noexcept;
     void print_variant_stats() const;
 
     static str to_string(const pyAttrValue& src);
 
 private:
+    using CacheIterator = tsl::sparse_map<str, MarkedItem>::iterator;
+    using ReadLock = std::shared_lock<StripedSharedMutex>;
+    using WriteLock = std::unique_lock<StripedSharedMutex>;
+
+    // unlocked bodies of the public methods of the same name, for callers already holding the lock
+    bool setTtl(const str& item_id, double ttl_seconds);
+    bool patchItem(const str& item_id, const std::unordered_map<str, pyAttrValue>& attributes);
+    void beginTransaction(uint64_t estimated_number_of_items, bool remove_old_items);
+    void endTransaction();
+    bool patchIndexed(const str& item_id, std::vector<IndexedValue>& values);
+    void replayFrame(transaction_log::Reader& in);
+    size_t sweepExpired(size_t max_items);
+    // drops the stale entries of expiryQueue once they outnumber the live ones
+    void compactExpiryQueue();
+    size_t compactAttributes();
+    // sets the CLOCK bit from a reader, which only holds the shared lock
+    static void markReferenced(MarkedItem& item) noexcept;
+
+    std::vector<pyAttrValue> lookup(const str& id, const strVec& attributes);
+    [[nodiscard]] bool isExpired(const str& id, const MarkedItem& item) const;
+    template <class Fill>
+    MarkedItem& upsertItem(const str& id, Fill&& fill);
+    void upsertIndexed(const str& id, std::vector<IndexedValue>& values);
+    // apply(item, patched) patches the found item; it records the patched attribute indexes in
+    // `patched` only when a transaction log is attached, so a patch without one does not allocate
+    template <class Apply>
+    bool patchWith(const str& id, Apply&& apply);
+    // rowAt(i) points at the attributes.size() values of ids[i]; the caller has checked the shape
+    template <class RowAt>
+    size_t addMany(const strVec& ids, const strVec& attributes, RowAt&& rowAt);
+    CacheIterator eraseItem(CacheIterator it);
+    void reserveItems(size_t count);
+    static size_t itemBytes(const str& id, const MarkedItem& item) noexcept;
+    void enforceBudget();
     void setMarkedItem(MarkedItem& item, const std::unordered_map<str, pyAttrValue>& attrs);
-    static pyAttrValue convert_valueJ(const json::AttributeValue& src);
-    static AttributeValue convert_value(const json::AttributeValue& src);
+    static void setMarkedItem(MarkedItem& item, std::vector<IndexedValue>& attrs);
+    static void patchMarkedItem(MarkedItem& item, uint8_t idx, AttributeValue&& value);
+    bool stripDroppedAttributes(MarkedItem& item) const;
+    size_t insert_page(ParsedPage& page);
+    // load_page for a document followed by readable bytes up to json_text.data() + readable
+    size_t loadPage(std::string_view json_text, size_t readable);
+    void rebuildOrderedIndex();
+    [[nodiscard]] std::string buildSharedImage(uint64_t generation) const;
+    // rows for the ordered-index keys >= lo while keep(key) holds
+    template <class Keep>
+    std::vector<Row> orderedScan(std::string_view lo, Keep&& keep, const strVec& attributes, size_t limit) const;
+    std::vector<ParsedPage> parse_file(const str& path) const;
+    static void appendCell(Column& column, const AttributeValue* value);
+    [[nodiscard]] std::vector<std::optional<uint8_t>> resolveAttributes(const strVec& attributes) const;
+    static std::vector<pyAttrValue> project(const MarkedItem& item, const std::vector<std::optional<uint8_t>>& idxs);
     static pyAttrValue convert_value(const AttributeValue& src);
     static AttributeValue convert_value(const pyAttrValue& src);
+    static AttributeValue convert_value(pyAttrValue&& src);
 
 public:
     tsl::sparse_map<str, MarkedItem> cache;
-    absl::flat_hash_map<str, uint8_t, absl::Hash<str>> attrMap;
+    AttrMap attrMap;
     strVec attrIdx;
-    const uint8_t numberOfAttributes;
+    uint8_t numberOfAttributes; // attribute indices in use, including dropped ones awaiting compaction
     size_t oldCacheSize = 0;
+    uint64_t keysGeneration = 0; // bumped whenever `cache` gains or loses a key or rehashes
+    uint64_t schemaGeneration = 0; // bumped whenever an attribute is added or dropped
     bool transactionOpened = false;
     bool transactionShouldRemoveOldItems = true;
+
+private:
+    mutable StripedSharedMutex mutex;
+    std::unique_ptr<PageParser> parser;
+    std::unique_ptr<OrderedIdIndex> orderedIndex;
+    std::unique_ptr<transaction_log::Writer> transactionLog;
+
+    // dropped attribute indices still set on some items, and compacted ones free for add_attribute()
+    std::array<uint32_t, 3> droppedFlags{};
+    std::vector<uint8_t> freeAttributeIdxs;
+
+    // eviction: approximate CLOCK over `cache` within memoryBudget bytes (0 = unbounded)
+    size_t memoryBudget = 0;
+    size_t trackedBytes = 0;
+    str clockHand;
+    absl::flat_hash_map<str, Clock::time_point> expiries;
+    // min-heap of (deadline, id); entries whose deadline no longer matches `expiries` are stale
+    std::priority_queue<std::pair<Clock::time_point, str>, std::vector<std::pair<Clock::time_point, str>>,
+                        std::greater<>> expiryQueue;
+    EvictionStats evictionStats;
+#ifdef SMALL_CACHE_HAS_METRICS
+    mutable CacheMetrics cacheMetrics;
+#endif
 };
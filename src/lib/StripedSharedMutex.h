@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <shared_mutex>
+
+// Reader-writer lock split into cache-line-sized stripes. A reader only locks the stripe of its
+// thread, so readers on different cores do not bounce one lock word between them; a writer locks
+// every stripe in order. Satisfies SharedMutex, so it works with std::shared_lock and std::unique_lock.
+// Not recursive: a thread holding it in either mode must not lock it again.
+class StripedSharedMutex
+{
+public:
+    static constexpr size_t stripeCount = 16;
+
+    void lock()
+    {
+        for (auto& stripe : stripes)
+            stripe.mutex.lock();
+    }
+
+    bool try_lock()
+    {
+        for (size_t i = 0; i < stripeCount; ++i)
+        {
+            if (!stripes[i].mutex.try_lock())
+            {
+                while (i-- > 0)
+                    stripes[i].mutex.unlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void unlock()
+    {
+        for (size_t i = stripeCount; i-- > 0;)
+            stripes[i].mutex.unlock();
+    }
+
+    void lock_shared() { stripes[this_thread_stripe()].mutex.lock_shared(); }
+    bool try_lock_shared() { return stripes[this_thread_stripe()].mutex.try_lock_shared(); }
+    void unlock_shared() { stripes[this_thread_stripe()].mutex.unlock_shared(); }
+
+    // Threads are dealt stripes round-robin once, so a thread always unlocks the stripe it locked.
+    // Also used to shard other per-reader state the same way.
+    static size_t this_thread_stripe() noexcept
+    {
+        static std::atomic<size_t> nextStripe{0};
+        thread_local const size_t stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % stripeCount;
+        return stripe;
+    }
+
+private:
+    struct alignas(64) Stripe
+    {
+        std::shared_mutex mutex;
+    };
+
+    std::array<Stripe, stripeCount> stripes;
+};
@@ -0,0 +1,520 @@
+#include "TransactionLog.h"
+#include "Overloaded.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <bit>
+#include <filesystem>
+#include <format>
+
+using namespace transaction_log;
+
+Writer::Writer(const std::string& path, size_t max_buffered) : toFile(!path.empty()), maxBuffered(max_buffered)
+{
+    if (toFile)
+    {
+        file.open(path, std::ios::binary | std::ios::app);
+        if (!file)
+            throw std::runtime_error(std::format("Cannot open transaction log {}", path));
+    }
+}
+
+void Writer::begin(uint64_t estimated_items)
+{
+    out.push_back(static_cast<char>(Record::Begin));
+    put_varint(out, estimated_items);
+    inTransaction = true;
+}
+
+void Writer::end()
+{
+    out.push_back(static_cast<char>(Record::End));
+    inTransaction = false;
+    commit();
+}
+
+void Writer::upsert(const std::string& id, const SmallCache::MarkedItem& item, const SmallCache::strVec& attrIdx)
+{
+    startRecord(Record::Upsert, id);
+    const auto idxs = item.getIdxs();
+    // dropped attributes awaiting compaction have no name any more and are left out
+    const auto named = [&](size_t idx) { return !attrIdx[idx].empty(); };
+    put_varint(body, static_cast<uint64_t>(std::ranges::count_if(idxs, named)));
+    for (size_t i = 0; i < idxs.size(); ++i)
+    {
+        if (!named(idxs[i]))
+            continue;
+        put_varint(body, nameId(static_cast<uint8_t>(idxs[i]), attrIdx));
+        appendValue(item.value[i]);
+    }
+    finishRecord();
+}
+
+void Writer::patch(const std::string& id, const SmallCache::MarkedItem& item,
+                   const std::vector<uint8_t>& patched, const SmallCache::strVec& attrIdx)
+{
+    startRecord(Record::Patch, id);
+    put_varint(body, patched.size());
+    for (const auto idx : patched)
+    {
+        put_varint(body, nameId(idx, attrIdx));
+        const auto value = item.getValue(idx);
+        appendValue(value ? value->get() : SmallCache::AttributeValue{});
+    }
+    finishRecord();
+}
+
+void Writer::remove(const std::string& id)
+{
+    startRecord(Record::Remove, id);
+    finishRecord();
+}
+
+void Writer::schema_changed() noexcept
+{
+    nameIds.clear(); // an attribute index may now carry another name
+}
+
+std::string Writer::take()
+{
+    if (overflowed)
+    {
+        overflowed = false;
+        out.erase(0, committed);
+        committed = 0;
+        throw std::runtime_error(std::format("Transaction log overflowed {} buffered bytes and dropped frames; "
+                                             "replicas must be rebuilt", maxBuffered));
+    }
+    std::string frames = out.substr(0, committed);
+    out.erase(0, committed);
+    committed = 0;
+    return frames;
+}
+
+void Writer::startRecord(Record tag, std::string_view id)
+{
+    body.clear();
+    body.push_back(static_cast<char>(tag));
+    put_varint(body, id.size());
+    body.append(id);
+}
+
+void Writer::appendValue(const SmallCache::AttributeValue& value)
+{
+    std::visit(overloaded{
+                   [&](std::monostate) { body.push_back(static_cast<char>(ValueType::Null)); },
+                   [&](bool b) { body.push_back(static_cast<char>(b ? ValueType::True : ValueType::False)); },
+                   [&](double d)
+                   {
+                       body.push_back(static_cast<char>(ValueType::Double));
+                       const auto bits = std::bit_cast<uint64_t>(d);
+                       for (unsigned i = 0; i < 8; ++i)
+                           body.push_back(static_cast<char>(bits >> (8 * i)));
+                   },
+                   [&](const SmallCache::fwStr& s)
+                   {
+                       const auto id = stringId(s);
+                       body.push_back(static_cast<char>(ValueType::String));
+                       put_varint(body, id);
+                   },
+                   [&](const SmallCache::fwStrVec& list)
+                   {
+                       const auto id = listId(list);
+                       body.push_back(static_cast<char>(ValueType::List));
+                       put_varint(body, id);
+                   },
+               }, value);
+}
+
+uint64_t Writer::nameId(uint8_t idx, const SmallCache::strVec& attrIdx)
+{
+    if (nameIds.size() <= idx)
+        nameIds.resize(idx + 1, 0);
+    if (nameIds[idx] == 0)
+    {
+        nameIds[idx] = nextString + 1;
+        defineString(attrIdx[idx]);
+    }
+    return nameIds[idx] - 1;
+}
+
+uint64_t Writer::stringId(const SmallCache::fwStr& s)
+{
+    const auto [it, inserted] = stringIds.try_emplace(&s.get(), nextString);
+    if (inserted)
+    {
+        pinnedStrings.push_back(s);
+        defineString(s.get());
+    }
+    return it->second;
+}
+
+uint64_t Writer::listId(const SmallCache::fwStrVec& list)
+{
+    if (const auto it = listIds.find(&list.get()); it != listIds.end())
+        return it->second;
+    std::vector<uint64_t> ids;
+    ids.reserve(list.get().size());
+    for (const auto& s : list.get())
+        ids.push_back(stringId(s));
+    out.push_back(static_cast<char>(Record::List));
+    put_varint(out, ids.size());
+    for (const auto id : ids)
+        put_varint(out, id);
+    const uint64_t id = listIds.size();
+    listIds.emplace(&list.get(), id);
+    pinnedLists.push_back(list);
+    return id;
+}
+
+void Writer::defineString(std::string_view s)
+{
+    out.push_back(static_cast<char>(Record::String));
+    put_varint(out, s.size());
+    out.append(s);
+    ++nextString;
+}
+
+void Writer::finishRecord()
+{
+    out.append(body);
+    if (!inTransaction)
+        commit();
+}
+
+void Writer::commit()
+{
+    committed = out.size();
+    stringIds.clear();
+    listIds.clear();
+    pinnedStrings.clear();
+    pinnedLists.clear();
+    nameIds.clear();
+    nextString = 0;
+    if (toFile)
+    {
+        file.write(out.data(), static_cast<std::streamsize>(out.size()));
+        file.flush();
+        out.clear();
+        committed = 0;
+        if (!file)
+            throw std::runtime_error("Cannot write transaction log");
+    }
+    else if (overflowed || committed > maxBuffered)
+    {
+        // nobody takes the frames: drop them rather than grow without bound, and let take() report it
+        overflowed = true;
+        out.clear();
+        committed = 0;
+    }
+}
+
+uint8_t Reader::byte()
+{
+    if (p == end)
+        throw std::runtime_error("Truncated transaction log");
+    return static_cast<uint8_t>(*p++);
+}
+
+std::string_view Reader::bytes(uint64_t n)
+{
+    if (n > remaining())
+        throw std::runtime_error("Truncated transaction log");
+    const std::string_view s(p, n);
+    p += n;
+    return s;
+}
+
+double Reader::number()
+{
+    const auto raw = bytes(8);
+    uint64_t bits = 0;
+    for (unsigned i = 0; i < 8; ++i)
+        bits |= uint64_t{static_cast<uint8_t>(raw[i])} << (8 * i);
+    return std::bit_cast<double>(bits);
+}
+
+size_t FrameScanner::next(std::string_view log) noexcept
+{
+    Reader in(log.substr(offset));
+    const auto frameEnd = [&]
+    {
+        const size_t size = log.size() - in.remaining();
+        offset = 0;
+        began = false;
+        return size;
+    };
+    // consumes what is there, so that a field cut short always leaves the reader at the end
+    const auto skip = [&](uint64_t n)
+    {
+        const auto available = in.remaining();
+        in.bytes(std::min(n, available));
+        if (n > available)
+            throw std::runtime_error("Truncated transaction log");
+    };
+    const auto skipValues = [&]
+    {
+        for (auto count = in.varint(); count > 0; --count)
+        {
+            in.varint();
+            switch (static_cast<ValueType>(in.byte()))
+            {
+            case ValueType::Null:
+            case ValueType::False:
+            case ValueType::True: break;
+            case ValueType::Double: skip(8); break;
+            case ValueType::String:
+            case ValueType::List: in.varint(); break;
+            default: return false;
+            }
+        }
+        return true;
+    };
+
+    try
+    {
+        while (true)
+        {
+            offset = log.size() - in.remaining();
+            switch (static_cast<Record>(in.byte()))
+            {
+            case Record::String:
+                skip(in.varint());
+                break;
+            case Record::List:
+                for (auto count = in.varint(); count > 0; --count)
+                    in.varint();
+                break;
+            case Record::Begin:
+                in.varint();
+                if (began)
+                    return frameEnd();
+                began = true;
+                break;
+            case Record::Upsert:
+            case Record::Patch:
+                skip(in.varint());
+                if (!skipValues() || !began)
+                    return frameEnd();
+                break;
+            case Record::Remove:
+                skip(in.varint());
+                if (!began)
+                    return frameEnd();
+                break;
+            default: // End, or a malformed record
+                return frameEnd();
+            }
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        // out of input, unless a varint was malformed
+        return in.done() ? 0 : frameEnd();
+    }
+}
+
+void SmallCache::enable_transaction_log(const str& path, size_t max_buffered)
+{
+    const WriteLock lock(mutex);
+    if (transactionOpened)
+    {
+        throw std::runtime_error("Cannot switch the transaction log inside a transaction");
+    }
+    transactionLog = std::make_unique<Writer>(path, max_buffered);
+}
+
+void SmallCache::disable_transaction_log()
+{
+    const WriteLock lock(mutex);
+    if (transactionOpened)
+    {
+        throw std::runtime_error("Cannot switch the transaction log inside a transaction");
+    }
+    transactionLog.reset();
+}
+
+std::string SmallCache::take_transaction_log()
+{
+    const WriteLock lock(mutex);
+    return transactionLog ? transactionLog->take() : std::string{};
+}
+
+size_t SmallCache::apply_log(std::string_view log)
+{
+    SMALL_CACHE_TIME_SCOPE(apply_log_ns);
+    Reader in(log);
+    size_t frames = 0;
+    while (!in.done())
+    {
+        // one frame at a time, so that readers get in between transactions
+        const WriteLock lock(mutex);
+        replayFrame(in);
+        ++frames;
+    }
+    return frames;
+}
+
+size_t SmallCache::apply_log_file(const str& path)
+{
+    if (std::filesystem::is_regular_file(path))
+    {
+        const MappedFile file(path);
+        return apply_log(file.view());
+    }
+    // pipes cannot be mapped: apply each frame as soon as it has arrived, until the writer closes its end
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream)
+    {
+        throw std::runtime_error(std::format("Cannot open transaction log {}", path));
+    }
+    auto& in = *stream.rdbuf();
+    FrameScanner scanner;
+    std::string pending; // the frame being received
+    size_t frames = 0;
+    // sgetc() waits for the writer, after which whatever it sent is buffered
+    while (in.sgetc() != std::char_traits<char>::eof())
+    {
+        const auto old = pending.size();
+        const auto available = std::max<std::streamsize>(in.in_avail(), 1);
+        pending.resize(old + static_cast<size_t>(available));
+        pending.resize(old + static_cast<size_t>(in.sgetn(pending.data() + old, available)));
+        size_t used = 0;
+        while (const auto size = scanner.next(std::string_view(pending).substr(used)))
+        {
+            frames += apply_log(std::string_view(pending).substr(used, size));
+            used += size;
+        }
+        pending.erase(0, used);
+    }
+    if (!pending.empty())
+    {
+        throw std::runtime_error("Truncated transaction log");
+    }
+    return frames;
+}
+
+void SmallCache::replayFrame(Reader& in)
+{
+    std::vector<fwStr> strings;
+    std::vector<fwStrVec> lists;
+    std::vector<int16_t> names; // per string id: attribute index, -1 if unknown here, -2 if not resolved yet
+
+    const auto string = [&](uint64_t id) -> const fwStr&
+    {
+        if (id >= strings.size())
+            throw std::runtime_error("Undefined string in transaction log");
+        return strings[id];
+    };
+    const auto readValue = [&]() -> AttributeValue
+    {
+        switch (static_cast<ValueType>(in.byte()))
+        {
+        case ValueType::Null: return std::monostate{};
+        case ValueType::False: return false;
+        case ValueType::True: return true;
+        case ValueType::Double: return in.number();
+        case ValueType::String: return string(in.varint());
+        case ValueType::List:
+        {
+            const auto id = in.varint();
+            if (id >= lists.size())
+                throw std::runtime_error("Undefined list in transaction log");
+            return lists[id];
+        }
+        }
+        throw std::runtime_error("Unknown value type in transaction log");
+    };
+    std::vector<IndexedValue> values;
+    const auto readValues = [&]
+    {
+        values.clear();
+        for (auto count = in.varint(); count > 0; --count)
+        {
+            const auto name = in.varint();
+            const auto& attribute = string(name);
+            names.resize(strings.size(), -2);
+            if (names[name] == -2)
+            {
+                const auto it = attrMap.find(attribute.get());
+                names[name] = it != attrMap.end() ? it->second : -1;
+            }
+            auto value = readValue();
+            if (names[name] >= 0)
+                values.emplace_back(static_cast<uint8_t>(names[name]), std::move(value));
+        }
+    };
+
+    bool began = false;
+    try
+    {
+        while (true)
+        {
+            switch (static_cast<Record>(in.byte()))
+            {
+            case Record::String:
+                strings.emplace_back(str(in.bytes(in.varint())));
+                break;
+            case Record::List:
+            {
+                std::vector<fwStr> list;
+                for (auto count = in.varint(); count > 0; --count)
+                    list.push_back(string(in.varint()));
+                lists.emplace_back(std::move(list));
+                break;
+            }
+            case Record::Begin:
+            {
+                if (began)
+                    throw std::runtime_error("Nested Begin in transaction log");
+                // removals are logged explicitly, so old items must not be dropped here; the estimate
+                // is untrusted, but an item takes at least three bytes of log
+                const auto estimated = std::min<uint64_t>(in.varint(), in.remaining() / 3);
+                beginTransaction(estimated, false);
+                began = true;
+                break;
+            }
+            case Record::Upsert:
+            {
+                if (!began)
+                    throw std::runtime_error("Upsert outside a transaction in transaction log");
+                const str id(in.bytes(in.varint()));
+                readValues();
+                upsertIndexed(id, values);
+                enforceBudget();
+                break;
+            }
+            case Record::Patch:
+            {
+                const str id(in.bytes(in.varint()));
+                readValues();
+                patchIndexed(id, values);
+                if (!began)
+                    return;
+                break;
+            }
+            case Record::Remove:
+            {
+                const str id(in.bytes(in.varint()));
+                if (const auto it = cache.find(id); it != cache.end())
+                    eraseItem(it);
+                if (!began)
+                    return;
+                break;
+            }
+            case Record::End:
+                if (!began)
+                    throw std::runtime_error("End without Begin in transaction log");
+                endTransaction();
+                return;
+            default:
+                throw std::runtime_error("Unknown record in transaction log");
+            }
+        }
+    }
+    catch (...)
+    {
+        if (began && transactionOpened)
+            endTransaction(); // keep what was applied and leave the cache usable
+        throw;
+    }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "SmallCache.h"
+#include "Varint.h"
+#include <absl/container/flat_hash_map.h>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary delta log of SmallCache mutations, replayed by SmallCache::apply_log() without any JSON
+// parsing. A log is a sequence of records, each a tag byte followed by varints:
+//
+//   Begin   estimated_items
+//   String  length bytes                                 defines the next string id
+//   List    count string_id[count]                       defines the next list id
+//   Upsert  id_length id_bytes count (name_id value)[count]
+//   Patch   id_length id_bytes count (name_id value)[count]    a Null value removes the attribute
+//   Remove  id_length id_bytes
+//   End
+//
+// A value is a ValueType byte followed by 8 little-endian bytes for Double, a string id for String
+// or a list id for List. Attribute names are strings too, so the receiving cache resolves them
+// against its own schema and skips unknown ones, as load_page does.
+//
+// Records are grouped into frames: Begin..End for a transaction, or a single Patch or Remove made
+// outside one, each preceded by the String and List records it uses. String and list ids are local
+// to a frame, so any frame can be replayed on its own. Removals are explicit (including the old
+// items a transaction drops when it ends), so replay never removes items by itself.
+namespace transaction_log
+{
+    enum class Record : uint8_t
+    {
+        Begin = 1,
+        String,
+        List,
+        Upsert,
+        Patch,
+        Remove,
+        End,
+    };
+
+    enum class ValueType : uint8_t
+    {
+        Null,
+        False,
+        True,
+        Double,
+        String,
+        List,
+    };
+
+    // Encodes the mutations of one cache. With an empty path complete frames stay in memory until
+    // take(); otherwise each one is appended to the file (or pipe) at `path` as soon as it is complete.
+    // In memory, once more than `max_buffered` bytes of frames are waiting, they and every frame after
+    // them are dropped until take() throws to report the gap.
+    class Writer
+    {
+    public:
+        Writer(const std::string& path, size_t max_buffered);
+
+        void begin(uint64_t estimated_items);
+        void end();
+        void upsert(const std::string& id, const SmallCache::MarkedItem& item, const SmallCache::strVec& attrIdx);
+        // logs the current value (or absence) of each patched attribute
+        void patch(const std::string& id, const SmallCache::MarkedItem& item,
+                   const std::vector<uint8_t>& patched, const SmallCache::strVec& attrIdx);
+        void remove(const std::string& id);
+        // called when attribute names change, since records name attributes rather than index them
+        void schema_changed() noexcept;
+        // complete frames written since the last call; only used without a file
+        [[nodiscard]] std::string take();
+
+    private:
+        void startRecord(Record tag, std::string_view id);
+        void appendValue(const SmallCache::AttributeValue& value);
+        uint64_t nameId(uint8_t idx, const SmallCache::strVec& attrIdx);
+        uint64_t stringId(const SmallCache::fwStr& s);
+        uint64_t listId(const SmallCache::fwStrVec& list);
+        void defineString(std::string_view s);
+        // moves the encoded record after the definitions it needs; closes the frame outside a transaction
+        void finishRecord();
+        void commit();
+
+        std::ofstream file;
+        bool toFile;
+        size_t maxBuffered;
+        bool overflowed = false; // frames were dropped since the last take()
+        bool inTransaction = false;
+        std::string out;      // encoded records; the first `committed` bytes are complete frames
+        size_t committed = 0;
+        std::string body;     // record being encoded
+        // per-frame tables, keyed by interned identity; the handles keep the addresses from being reused
+        absl::flat_hash_map<const void*, uint64_t> stringIds;
+        absl::flat_hash_map<const void*, uint64_t> listIds;
+        std::vector<SmallCache::fwStr> pinnedStrings;
+        std::vector<SmallCache::fwStrVec> pinnedLists;
+        std::vector<uint64_t> nameIds; // per attribute index: string id + 1, 0 = not defined in this frame
+        uint64_t nextString = 0;
+    };
+
+    // Bounds-checked cursor over an untrusted log.
+    class Reader
+    {
+    public:
+        explicit Reader(std::string_view log) noexcept : p(log.data()), end(log.data() + log.size()) {}
+
+        [[nodiscard]] bool done() const noexcept { return p == end; }
+        [[nodiscard]] uint64_t remaining() const noexcept { return static_cast<uint64_t>(end - p); }
+        uint8_t byte();
+        uint64_t varint() { return get_varint(p, end); }
+        std::string_view bytes(uint64_t n);
+        double number();
+
+    private:
+        const char* p;
+        const char* end;
+    };
+
+    // Finds frame boundaries in a log that arrives in pieces, such as one read from a pipe, by
+    // skipping over records without decoding them.
+    class FrameScanner
+    {
+    public:
+        // Length of the first frame in `log`, or 0 while it is cut short. Until a frame is returned,
+        // each call must pass the bytes of the previous one again, followed by whatever has arrived
+        // since. Malformed input ends the frame early, so that replaying it reports the error.
+        size_t next(std::string_view log) noexcept;
+
+    private:
+        size_t offset = 0;  // start of the first record not scanned completely yet
+        bool began = false; // the frame scanned so far opened a transaction
+    };
+} // namespace transaction_log
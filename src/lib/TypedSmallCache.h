@@ -0,0 +1,431 @@
+#pragma once
+
+#include "SmallCache.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <format>
+#include <numeric>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Compile-time specialisation of SmallCache for an attribute set known at build time:
+//
+//   using Product = typed_schema::Schema<typed_schema::Field<"price", double>,
+//                                        typed_schema::Field<"tags", std::vector<std::string>>>;
+//   TypedSmallCache<Product> cache;
+//   const double* price = cache.find("42")->get<"price">();
+//
+// Items are plain tuples with a presence mask, so typed access has no variant dispatch and no name
+// lookup. Names seen at run time (JSON pages, get_one) go through a constexpr perfect hash.
+// Strings and string lists are interned like in SmallCache, and load_page reads values the same
+// way: list elements keep their raw JSON text (`"a"` with its quotes), as do non-scalar values of a
+// string field. Unlike SmallCache, a null value leaves the field absent instead of storing "".
+namespace typed_schema
+{
+    template <size_t N>
+    struct FixedString
+    {
+        char value[N]{};
+
+        constexpr FixedString(const char (&s)[N]) // implicit, so that `Field<"name", T>` works
+        {
+            std::copy_n(s, N, value);
+        }
+
+        [[nodiscard]] constexpr std::string_view view() const noexcept { return {value, N - 1}; }
+    };
+
+    template <FixedString Name, class T>
+    struct Field
+    {
+        static constexpr std::string_view name = Name.view();
+        using type = T;
+    };
+
+    template <class T>
+    concept FieldType = std::same_as<T, double> || std::same_as<T, bool> || std::same_as<T, std::string> ||
+        std::same_as<T, std::vector<std::string>>;
+
+    // how a declared field type is stored
+    template <class T>
+    struct storage
+    {
+        using type = T;
+    };
+    template <>
+    struct storage<std::string>
+    {
+        using type = SmallCache::fwStr;
+    };
+    template <>
+    struct storage<std::vector<std::string>>
+    {
+        using type = SmallCache::fwStrVec;
+    };
+    template <class T>
+    using storage_t = typename storage<T>::type;
+
+    template <class T, class V>
+    storage_t<T> to_storage(V&& value)
+    {
+        if constexpr (std::same_as<T, std::vector<std::string>>)
+            return SmallCache::fwStrVec{std::vector<SmallCache::fwStr>(value.begin(), value.end())};
+        else
+            return storage_t<T>(std::forward<V>(value));
+    }
+
+    template <class S>
+    SmallCache::pyAttrValue to_python(const S& value)
+    {
+        if constexpr (std::same_as<S, SmallCache::fwStrVec>)
+        {
+            SmallCache::strVec out;
+            out.reserve(value.get().size());
+            for (const auto& s : value.get())
+                out.push_back(s.get());
+            return out;
+        }
+        else if constexpr (std::same_as<S, SmallCache::fwStr>)
+            return value.get();
+        else
+            return value;
+    }
+
+    [[nodiscard]] constexpr uint64_t hash(uint64_t seed, std::string_view s) noexcept
+    {
+        uint64_t h = 0xcbf29ce484222325 ^ (seed * 0x9e3779b97f4a7c15);
+        for (const char c : s)
+        {
+            h ^= static_cast<uint8_t>(c);
+            h *= 0x100000001b3;
+        }
+        h ^= h >> 33; // the low bits index the table, so fold the high ones in
+        h *= 0xff51afd7ed558ccd;
+        return h ^ (h >> 33);
+    }
+
+    // Hash-and-displace perfect hash over N distinct names: a name's first-level bucket selects
+    // the seed that places it in a slot no other name uses. Built entirely at compile time.
+    template <size_t N>
+    class PerfectHash
+    {
+    public:
+        static constexpr size_t tableSize = std::bit_ceil(std::max<size_t>(2 * N, 2));
+
+        constexpr explicit PerfectHash(const std::array<std::string_view, N>& keys) : names(keys)
+        {
+            constexpr uint64_t mask = tableSize - 1;
+            std::array<size_t, tableSize> bucketSize{};
+            for (const auto key : keys)
+                ++bucketSize[hash(0, key) & mask];
+
+            // place the fullest buckets first, while most slots are still free
+            std::array<size_t, N> order{};
+            std::iota(order.begin(), order.end(), size_t{0});
+            const auto bucketOf = [&](size_t k) { return hash(0, keys[k]) & mask; };
+            std::ranges::sort(order, [&](size_t a, size_t b)
+            {
+                return bucketSize[bucketOf(a)] != bucketSize[bucketOf(b)]
+                           ? bucketSize[bucketOf(a)] > bucketSize[bucketOf(b)]
+                           : bucketOf(a) < bucketOf(b);
+            });
+
+            for (size_t start = 0; start < N;)
+            {
+                const auto bucket = bucketOf(order[start]);
+                size_t end = start;
+                while (end < N && bucketOf(order[end]) == bucket)
+                    ++end;
+                for (uint64_t seed = 1;; ++seed)
+                {
+                    std::array<size_t, N> picked{};
+                    bool fits = true;
+                    for (size_t k = start; k < end && fits; ++k)
+                    {
+                        picked[k - start] = hash(seed, keys[order[k]]) & mask;
+                        fits = slots[picked[k - start]] == 0 &&
+                            std::find(picked.begin(), picked.begin() + (k - start), picked[k - start]) ==
+                            picked.begin() + (k - start);
+                    }
+                    if (!fits)
+                        continue;
+                    for (size_t k = start; k < end; ++k)
+                        slots[picked[k - start]] = static_cast<uint8_t>(order[k] + 1);
+                    seeds[bucket] = seed;
+                    break;
+                }
+                start = end;
+            }
+        }
+
+        [[nodiscard]] constexpr std::optional<size_t> find(std::string_view name) const noexcept
+        {
+            constexpr uint64_t mask = tableSize - 1;
+            const auto slot = slots[hash(seeds[hash(0, name) & mask], name) & mask];
+            if (slot != 0 && names[slot - 1] == name)
+                return slot - 1;
+            return std::nullopt;
+        }
+
+    private:
+        std::array<std::string_view, N> names;
+        std::array<uint64_t, tableSize> seeds{};
+        std::array<uint8_t, tableSize> slots{}; // name index + 1, 0 = empty
+    };
+
+    template <class... Fields>
+    struct Schema
+    {
+        static constexpr size_t size = sizeof...(Fields);
+        static_assert(size > 0 && size <= 64, "a schema has between 1 and 64 fields");
+        static_assert((FieldType<typename Fields::type> && ...),
+                      "field types are double, bool, std::string or std::vector<std::string>");
+
+        static constexpr std::array<std::string_view, size> names{Fields::name...};
+        static_assert([]
+        {
+            auto sorted = names;
+            std::ranges::sort(sorted);
+            return std::ranges::adjacent_find(sorted) == sorted.end();
+        }(), "field names must be unique");
+
+        using Values = std::tuple<storage_t<typename Fields::type>...>;
+        using Mask = std::conditional_t<size <= 8, uint8_t, std::conditional_t<size <= 16, uint16_t,
+                                        std::conditional_t<size <= 32, uint32_t, uint64_t>>>;
+        template <size_t I>
+        using field_type = typename std::tuple_element_t<I, std::tuple<Fields...>>::type;
+
+        static constexpr PerfectHash<size> lookup{names};
+
+        template <FixedString Name>
+        static consteval size_t index_of()
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                if (names[i] == Name.view())
+                    return i;
+            }
+            throw "no such field in the schema";
+        }
+    };
+}
+
+template <class Schema>
+class TypedSmallCache
+{
+public:
+    using str = SmallCache::str;
+    using strVec = SmallCache::strVec;
+    using Mask = typename Schema::Mask;
+
+    struct Item
+    {
+        Mask present{};
+        typename Schema::Values values{};
+        bool isNew = true;
+
+        template <typed_schema::FixedString Name>
+        [[nodiscard]] const auto* get() const noexcept
+        {
+            constexpr auto idx = Schema::template index_of<Name>();
+            return (present >> idx) & 1u ? &std::get<idx>(values) : nullptr;
+        }
+
+        template <typed_schema::FixedString Name, class V>
+        Item& set(V&& value)
+        {
+            constexpr auto idx = Schema::template index_of<Name>();
+            std::get<idx>(values) =
+                typed_schema::to_storage<typename Schema::template field_type<idx>>(std::forward<V>(value));
+            present |= Mask{1} << idx;
+            return *this;
+        }
+
+        template <typed_schema::FixedString Name>
+        Item& reset() noexcept
+        {
+            constexpr auto idx = Schema::template index_of<Name>();
+            present &= static_cast<Mask>(~(Mask{1} << idx));
+            return *this;
+        }
+    };
+
+    void add_item(const str& item_id, Item item)
+    {
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+        item.isNew = true;
+        cache.insert_or_assign(item_id, std::move(item));
+    }
+
+    [[nodiscard]] const Item* find(const str& id) const
+    {
+        const auto it = cache.find(id);
+        return it != cache.end() ? &it->second : nullptr;
+    }
+
+    // Same contract as SmallCache::get_one, for callers that only know attribute names at run time.
+    std::vector<SmallCache::pyAttrValue> get_one(const str& id, const strVec& attributes) const
+    {
+        const Item* item = find(id);
+        if (!item || attributes.empty())
+            return {};
+        std::vector<SmallCache::pyAttrValue> out;
+        out.reserve(attributes.size());
+        for (const auto& name : attributes)
+        {
+            const auto idx = Schema::lookup.find(name);
+            out.push_back(idx && ((item->present >> *idx) & 1u) ? converters[*idx](*item) : SmallCache::pyAttrValue{});
+        }
+        return out;
+    }
+
+    void begin_transaction(uint64_t estimated_number_of_items = 0, bool remove_old_items = true)
+    {
+        if (transactionOpened)
+        {
+            throw std::runtime_error("Transaction already open");
+        }
+        if (estimated_number_of_items != 0)
+        {
+            cache.reserve(estimated_number_of_items);
+        }
+        transactionOpened = true;
+        transactionShouldRemoveOldItems = remove_old_items;
+    }
+
+    void end_transaction()
+    {
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+        for (auto it = cache.begin(); it != cache.end();)
+        {
+            if (it->second.isNew)
+            {
+                it.value().isNew = false;
+                ++it;
+            }
+            else if (transactionShouldRemoveOldItems)
+            {
+                it = cache.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        transactionOpened = false;
+        transactionShouldRemoveOldItems = true;
+    }
+
+    // Moves each attribute value into its typed field; unknown attributes are skipped, null values
+    // leave the field absent and a value of the wrong JSON type throws. Returns the page count
+    // reported by the page, like SmallCache::load_page.
+    //
+    // Values are decoded once, into the json::AttributeValue variant SmallCache's glaze backend also
+    // uses, rather than by a reader generated for the schema: a page carries each attribute as its
+    // own {"id", "value"} object with the keys in any order, so the field a value belongs to may not
+    // be known until after the value has been read. What is left per value is one switch on the
+    // variant plus the move into the tuple; bench_SmallCache measures this against SmallCache::load_page.
+    size_t load_page(std::string_view json_text)
+    {
+        if (!transactionOpened)
+        {
+            throw std::runtime_error("Transaction not opened");
+        }
+        json::Response resp;
+        if (auto ec = glz::read<readOpts>(resp, json_text))
+            throw std::runtime_error(glz::format_error(ec, json_text));
+
+        for (auto& parsed : resp.result.data)
+        {
+            Item item;
+            for (auto& attr : parsed.attributes)
+            {
+                if (const auto idx = Schema::lookup.find(attr.id))
+                    assigners[*idx](item, attr.value);
+            }
+            add_item(parsed.id, std::move(item));
+        }
+        return resp.result.pagination.pages;
+    }
+
+    [[nodiscard]] size_t size() const noexcept { return cache.size(); }
+
+private:
+    static constexpr glz::opts readOpts{.null_terminated = false, .error_on_unknown_keys = false};
+
+    template <size_t I>
+    static void assign_field(Item& item, json::AttributeValue& value)
+    {
+        using T = typename Schema::template field_type<I>;
+        auto* raw = std::get_if<std::optional<glz::raw_json>>(&value);
+        if (raw && !*raw)
+        {
+            item.present &= static_cast<Mask>(~(Mask{1} << I));
+            return;
+        }
+        const auto mismatch = []
+        {
+            return std::runtime_error(std::format("Attribute {} has an unexpected JSON type", Schema::names[I]));
+        };
+        auto& field = std::get<I>(item.values);
+        if constexpr (std::same_as<T, std::string>)
+        {
+            if (auto* s = std::get_if<std::string>(&value))
+                field = SmallCache::fwStr{std::move(*s)};
+            else if (raw)
+                field = SmallCache::fwStr{std::move((*raw)->str)};
+            else
+                throw mismatch();
+        }
+        else if constexpr (std::same_as<T, std::vector<std::string>>)
+        {
+            auto* list = std::get_if<std::vector<glz::raw_json>>(&value);
+            if (!list)
+                throw mismatch();
+            std::vector<SmallCache::fwStr> elements;
+            elements.reserve(list->size());
+            for (auto& element : *list)
+                if (!element.str.empty())
+                    elements.emplace_back(std::move(element.str));
+            field = SmallCache::fwStrVec{std::move(elements)};
+        }
+        else
+        {
+            const auto* scalar = std::get_if<T>(&value);
+            if (!scalar)
+                throw mismatch();
+            field = *scalar;
+        }
+        item.present |= Mask{1} << I;
+    }
+
+    template <size_t I>
+    static SmallCache::pyAttrValue convert_field(const Item& item)
+    {
+        return typed_schema::to_python(std::get<I>(item.values));
+    }
+
+    // run-time field index -> the assigner/converter specialised for that field
+    static constexpr auto assigners = []<size_t... I>(std::index_sequence<I...>)
+    {
+        return std::array<void (*)(Item&, json::AttributeValue&), Schema::size>{&assign_field<I>...};
+    }(std::make_index_sequence<Schema::size>{});
+    static constexpr auto converters = []<size_t... I>(std::index_sequence<I...>)
+    {
+        return std::array<SmallCache::pyAttrValue (*)(const Item&), Schema::size>{&convert_field<I>...};
+    }(std::make_index_sequence<Schema::size>{});
+
+    tsl::sparse_map<str, Item> cache;
+    bool transactionOpened = false;
+    bool transactionShouldRemoveOldItems = true;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// LEB128 unsigned varints, as used by the compact on-disk and in-memory encodings.
+inline void put_varint(std::string& out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+// Decodes one varint at `p`, advancing it. The caller guarantees the encoding is complete.
+inline uint64_t get_varint(const char*& p) noexcept
+{
+    uint64_t v = 0;
+    for (unsigned shift = 0;; shift += 7)
+    {
+        const auto byte = static_cast<uint8_t>(*p++);
+        v |= uint64_t{byte & 0x7fu} << shift;
+        if (!(byte & 0x80))
+            return v;
+    }
+}
+
+// Bounds-checked variant for untrusted input.
+inline uint64_t get_varint(const char*& p, const char* end)
+{
+    uint64_t v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+            throw std::runtime_error("Truncated varint");
+        const auto byte = static_cast<uint8_t>(*p++);
+        v |= uint64_t{byte & 0x7fu} << shift;
+        if (!(byte & 0x80))
+            return v;
+    }
+    throw std::runtime_error("Malformed varint");
+}
@@ -0,0 +1,151 @@
+#include "SmallCache.h"
+#include "TypedSmallCache.h"
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    constexpr size_t pages_count = 20;
+    constexpr size_t items_per_page = 5000;
+    constexpr size_t lookups_per_thread = 1'000'000;
+
+    SmallCache::strVec bench_attributes()
+    {
+        return {"code", "label", "price", "active", "tags", "regions", "note"};
+    }
+
+    std::string make_page(size_t page)
+    {
+        std::string out = std::format(R"({{"result":{{"count":{},"pagination":{{"page":{},"pages":{}}},"data":[)",
+                                      items_per_page, page + 1, pages_count);
+        for (size_t i = 0; i < items_per_page; ++i)
+        {
+            const size_t id = page * items_per_page + i;
+            if (i != 0)
+                out += ',';
+            out += std::format(
+                R"({{"id":"item{}","attributes":[)"
+                R"({{"id":"code","value":"C{}"}},)"
+                R"({{"id":"label","value":"Label for item number {}"}},)"
+                R"({{"id":"price","value":{}.5}},)"
+                R"({{"id":"active","value":{}}},)"
+                R"({{"id":"tags","value":["tag{}","tag{}","common"]}},)"
+                R"({{"id":"regions","value":["eu","us"]}},)"
+                R"({{"id":"unknown","value":"ignored"}}]}})",
+                id, id % 1000, id, id % 500, i % 2 ? "true" : "false", id % 7, id % 13);
+        }
+        out += "]}}";
+        return out;
+    }
+
+    void bench_backend(ParserBackend backend, const char* name, const std::vector<std::string>& pages)
+    {
+        size_t bytes = 0;
+        for (const auto& p : pages)
+            bytes += p.size();
+
+        SmallCache cache(bench_attributes(), backend);
+        const auto start = std::chrono::steady_clock::now();
+        cache.begin_transaction(pages_count * items_per_page);
+        for (const auto& p : pages)
+            cache.load_page(p);
+        cache.end_transaction();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::println("{:<12}{:>14.1f}{:>14.1f}{:>14.3f}", name, pages.size() / elapsed.count(),
+                     bytes / elapsed.count() / (1024.0 * 1024.0), elapsed.count());
+    }
+
+    void bench_typed(const std::vector<std::string>& pages)
+    {
+        using typed_schema::Field;
+        using BenchSchema = typed_schema::Schema<Field<"code", std::string>, Field<"label", std::string>,
+                                                 Field<"price", double>, Field<"active", bool>,
+                                                 Field<"tags", std::vector<std::string>>,
+                                                 Field<"regions", std::vector<std::string>>, Field<"note", std::string>>;
+        size_t bytes = 0;
+        for (const auto& p : pages)
+            bytes += p.size();
+
+        TypedSmallCache<BenchSchema> cache;
+        const auto start = std::chrono::steady_clock::now();
+        cache.begin_transaction(pages_count * items_per_page);
+        for (const auto& p : pages)
+            cache.load_page(p);
+        cache.end_transaction();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::println("{:<12}{:>14.1f}{:>14.1f}{:>14.3f}", "typed", pages.size() / elapsed.count(),
+                     bytes / elapsed.count() / (1024.0 * 1024.0), elapsed.count());
+    }
+
+    // Every thread does the same number of get_one calls, so with perfect scaling the elapsed time
+    // stays flat and lookups/s grows with the thread count.
+    void bench_get_one(const std::vector<std::string>& pages)
+    {
+        SmallCache cache(bench_attributes());
+        cache.begin_transaction(pages_count * items_per_page);
+        for (const auto& p : pages)
+            cache.load_page(p);
+        cache.end_transaction();
+
+        std::vector<std::string> ids;
+        ids.reserve(pages_count * items_per_page);
+        for (size_t i = 0; i < pages_count * items_per_page; ++i)
+            ids.push_back(std::format("item{}", i));
+        const SmallCache::strVec attributes{"code", "price", "tags"};
+
+        const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            {
+                std::vector<std::jthread> workers;
+                for (size_t t = 0; t < threads; ++t)
+                {
+                    workers.emplace_back(
+                        [&, t]
+                        {
+                            // threads walk the ids with different strides so they do not share a hot item
+                            size_t i = t * 7919;
+                            for (size_t n = 0; n < lookups_per_thread; ++n, i += 2 * t + 1)
+                                (void)cache.get_one(ids[i % ids.size()], attributes);
+                        });
+                }
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::println("{:<12}{:>14.0f}{:>14.3f}", threads, threads * lookups_per_thread / elapsed.count(),
+                         elapsed.count());
+        }
+    }
+}
+
+int main()
+{
+    std::vector<std::string> pages;
+    pages.reserve(pages_count);
+    for (size_t p = 0; p < pages_count; ++p)
+        pages.push_back(make_page(p));
+
+    std::println("load_page: {} pages x {} items", pages_count, items_per_page);
+    std::println("{:<12}{:>14}{:>14}{:>14}", "backend", "pages/s", "MiB/s", "seconds");
+    std::println("{:-<54}", "");
+    bench_backend(ParserBackend::Glaze, "glaze", pages);
+    if (SmallCache::parser_backend_available(ParserBackend::Simdjson))
+        bench_backend(ParserBackend::Simdjson, "simdjson", pages);
+    else
+        std::println("{:<12}{:>14}", "simdjson", "not built");
+    bench_typed(pages);
+
+    std::println("");
+    std::println("get_one: {} lookups per thread", lookups_per_thread);
+    std::println("{:<12}{:>14}{:>14}", "threads", "lookups/s", "seconds");
+    std::println("{:-<40}", "");
+    bench_get_one(pages);
+    return 0;
+}
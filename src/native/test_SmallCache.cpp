@@ -1,10 +1,18 @@
 #include <gtest/gtest.h>
 #include "SmallCache.h"
+#include "SharedSegment.h"
+#include "TransactionLog.h"
+#include "TypedSmallCache.h"
 #include <vector>
 #include <string>
 #include <variant>
 #include <algorithm>
 #include <format>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <cmath>
 
 using namespace std::string_literals;
 
@@ -457,3 +465,1069 @@ TEST_F(SmallCacheTest, TransactionKeepOldItemsExtended)
     auto resB = cache.get_one("B", attrs);
     EXPECT_EQ(std::get<double>(resB[0]), 2.0);
 }
+
+TEST_F(SmallCacheTest, ParserBackends)
+{
+    std::vector<std::string> attrs = {"code", "price", "active", "tags", "missing"};
+    std::string json = R"({
+        "result": {
+            "count": 2,
+            "pagination": {"page": 1, "pages": 3},
+            "data": [
+                {
+                    "id": "item1",
+                    "attributes": [
+                        {"id": "code", "value": "old"},
+                        {"id": "price", "value": 9.5},
+                        {"id": "active", "value": true},
+                        {"id": "tags", "value": ["a", "b"]},
+                        {"id": "code", "value": "C1"}
+                    ]
+                },
+                {
+                    "attributes": [{"value": false, "id": "active"}],
+                    "id": "item2"
+                }
+            ]
+        }
+    })";
+
+    EXPECT_TRUE(SmallCache::parser_backend_available(ParserBackend::Glaze));
+    EXPECT_TRUE(SmallCache::parser_backend_available(SmallCache::default_parser_backend()));
+
+    for (auto backend : {ParserBackend::Glaze, ParserBackend::Simdjson})
+    {
+        if (!SmallCache::parser_backend_available(backend))
+        {
+            EXPECT_THROW(SmallCache({"a"}, backend), std::runtime_error);
+            continue;
+        }
+        SmallCache cache(attrs, backend);
+        EXPECT_EQ(cache.parser_backend(), backend);
+
+        cache.begin_transaction();
+        EXPECT_EQ(cache.load_page(json), 3);
+        EXPECT_THROW(cache.load_page("{ invalid json "), std::runtime_error);
+        cache.end_transaction();
+
+        auto res = cache.get_one("item1", attrs);
+        ASSERT_EQ(res.size(), 5);
+        EXPECT_EQ(std::get<std::string>(res[0]), "C1"); // last duplicate wins
+        EXPECT_EQ(std::get<double>(res[1]), 9.5);
+        EXPECT_EQ(std::get<bool>(res[2]), true);
+        EXPECT_EQ(std::get<std::vector<std::string>>(res[3]), (std::vector<std::string>{R"("a")", R"("b")"}));
+        EXPECT_TRUE(std::holds_alternative<std::monostate>(res[4]));
+
+        auto res2 = cache.get_one("item2", {"active"});
+        ASSERT_EQ(res2.size(), 1);
+        EXPECT_EQ(std::get<bool>(res2[0]), false);
+    }
+}
+
+TEST_F(SmallCacheTest, StringListsAreHashConsed)
+{
+    std::vector<std::string> attrs = {"tags", "regions"};
+    SmallCache cache(attrs);
+
+    cache.begin_transaction();
+    cache.add_item("1", {{"tags", std::vector<std::string>{"a", "b"}}, {"regions", std::vector<std::string>{"eu"}}});
+    cache.add_item("2", {{"tags", std::vector<std::string>{"a", "b"}}});
+    cache.add_item("3", {{"tags", std::vector<std::string>{"b", "a"}}});
+    cache.load_page(R"({"result": {"count": 1, "pagination": {"page": 1, "pages": 1}, "data": [
+        {"id": "4", "attributes": [{"id": "regions", "value": ["eu"]}]}]}})");
+    cache.end_transaction();
+
+    const auto list_of = [&](const std::string& id, size_t idx) -> const std::vector<SmallCache::fwStr>*
+    {
+        const auto value = cache.cache.at(id).getValue(idx);
+        return &std::get<SmallCache::fwStrVec>(value->get()).get();
+    };
+
+    EXPECT_EQ(list_of("1", 0), list_of("2", 0));
+    EXPECT_NE(list_of("1", 0), list_of("3", 0)); // order is part of the value
+
+    // lists from the JSON path are interned too; raw JSON text differs from the plain "eu" above
+    EXPECT_NE(list_of("1", 1), list_of("4", 1));
+    cache.begin_transaction(0, false);
+    cache.add_item("5", {{"regions", std::vector<std::string>{R"("eu")"}}});
+    cache.end_transaction();
+    EXPECT_EQ(list_of("4", 1), list_of("5", 1));
+
+    auto res = cache.get_one("3", attrs);
+    EXPECT_EQ(std::get<std::vector<std::string>>(res[0]), (std::vector<std::string>{"b", "a"}));
+    cache.print_variant_stats();
+}
+
+TEST_F(SmallCacheTest, LogHistogramBuckets)
+{
+    for (uint64_t v : {0ULL, 1ULL, 3ULL, 4ULL, 5ULL, 7ULL, 8ULL, 1000ULL, 123456789ULL})
+    {
+        const auto idx = LogHistogram::bucket_of(v);
+        EXPECT_LE(v, LogHistogram::upper_bound_of(idx));
+        if (idx > 0)
+            EXPECT_GT(v, LogHistogram::upper_bound_of(idx - 1));
+    }
+
+    LogHistogram h;
+    for (uint64_t v = 1; v <= 100; ++v)
+        h.record(v);
+    const auto snap = h.snapshot();
+    EXPECT_EQ(snap.count, 100);
+    EXPECT_EQ(snap.sum, 5050);
+    EXPECT_EQ(snap.max, 100);
+    EXPECT_GE(snap.p50, 50);
+    EXPECT_LE(snap.p50, 63);
+    EXPECT_GE(snap.p99, 99);
+}
+
+TEST_F(SmallCacheTest, Metrics)
+{
+    SmallCache cache({"val"});
+    cache.begin_transaction();
+    cache.add_item("1", {{"val", 1.0}});
+    cache.load_page(R"({"result": {"count": 1, "pagination": {"page": 1, "pages": 1}, "data": []}})");
+    cache.end_transaction();
+    cache.get_one("1", {"val"});
+    cache.get_one("missing", {"val"});
+    cache.get_many({"1", "2", "3"}, {"val"});
+
+    const auto m = cache.metrics();
+#ifdef SMALL_CACHE_HAS_METRICS
+    ASSERT_TRUE(m.enabled);
+    EXPECT_EQ(m.counters.at("get_one_hits"), 2);
+    EXPECT_EQ(m.counters.at("get_one_misses"), 3);
+    EXPECT_EQ(m.counters.at("items_added"), 1);
+    EXPECT_EQ(m.counters.at("pages_loaded"), 1);
+    EXPECT_EQ(m.counters.at("transactions"), 1);
+    EXPECT_EQ(m.histograms.at("get_one_ns").count, 2);
+    EXPECT_EQ(m.histograms.at("get_many_batch_size").max, 3);
+    EXPECT_EQ(m.histograms.at("end_transaction_ns").count, 1);
+
+    cache.reset_metrics();
+    EXPECT_EQ(cache.metrics().counters.at("get_one_hits"), 0);
+
+    // read-path counters are sharded per thread; metrics() must still see every thread's lookups
+    {
+        std::vector<std::jthread> readers;
+        for (int t = 0; t < 8; ++t)
+            readers.emplace_back([&] { for (int i = 0; i < 100; ++i) cache.get_one("1", {"val"}); });
+    }
+    const auto threaded = cache.metrics();
+    EXPECT_EQ(threaded.counters.at("get_one_hits"), 800);
+    EXPECT_EQ(threaded.histograms.at("get_one_ns").count, 800);
+
+    // ordered-index scans are timed apart from filter scans
+    cache.set_ordered_index(true);
+    EXPECT_EQ(cache.prefix_scan("1", {"val"}).size(), 1);
+    EXPECT_EQ(cache.range_scan("0", "2", {"val"}).size(), 1);
+    const auto scans = cache.metrics();
+    EXPECT_EQ(scans.histograms.at("ordered_scan_ns").count, 2);
+    EXPECT_EQ(scans.histograms.at("scan_ns").count, 0);
+#else
+    EXPECT_FALSE(m.enabled);
+    EXPECT_TRUE(m.counters.empty());
+#endif
+}
+
+TEST_F(SmallCacheTest, LoadPagesStream)
+{
+    SmallCache cache({"val", "label"});
+    const std::string page1 = R"({"result": {"count": 1, "pagination": {"page": 1, "pages": 2},
+        "data": [{"id": "1", "attributes": [{"id": "label", "value": "has } and \" inside"}]}]}})";
+    const std::string page2 = R"({"result":{"count":1,"pagination":{"page":2,"pages":2},)"
+        R"("data":[{"id":"2","attributes":[{"id":"val","value":2}]}]}})";
+
+    cache.begin_transaction();
+    EXPECT_EQ(cache.load_pages(page1 + "\n" + page2 + "\n"), 2);
+    EXPECT_EQ(cache.load_pages(page1 + page2), 2); // concatenated without separator
+    EXPECT_EQ(cache.load_pages(" \n"), 0);
+    EXPECT_THROW(cache.load_pages(page1 + "\nx"), std::runtime_error);
+    EXPECT_THROW(cache.load_pages(page1.substr(0, 20)), std::runtime_error);
+    cache.end_transaction();
+
+    EXPECT_EQ(std::get<std::string>(cache.get_one("1", {"label"})[0]), "has } and \" inside");
+    EXPECT_EQ(std::get<double>(cache.get_one("2", {"val"})[0]), 2.0);
+
+    // load_page works on views that are not NUL-terminated
+    const std::string both = page2 + "garbage";
+    cache.begin_transaction();
+    EXPECT_EQ(cache.load_page(std::string_view(both).substr(0, page2.size())), 2);
+    cache.end_transaction();
+}
+
+TEST_F(SmallCacheTest, LoadFileAndDirectory)
+{
+    const auto dir = std::filesystem::temp_directory_path() / "small_cache_load_directory_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const auto page = [](int id, double val)
+    {
+        return std::format(R"({{"result":{{"count":1,"pagination":{{"page":1,"pages":1}},)"
+                           R"("data":[{{"id":"{}","attributes":[{{"id":"val","value":{}}}]}}]}}}})", id, val);
+    };
+    for (int f = 0; f < 5; ++f)
+    {
+        std::ofstream(dir / std::format("dump_{}.json", f)) << page(f, f) << "\n" << page(100 + f, f) << "\n";
+    }
+    std::ofstream(dir / "dump_5.json") << page(0, 42.0); // later files override earlier ones
+    std::ofstream(dir / "empty.json");
+    std::ofstream(dir / "notes.txt") << "not json";
+
+    SmallCache cache({"val"});
+    cache.begin_transaction();
+    EXPECT_EQ(cache.load_file((dir / "dump_1.json").string()), 2);
+    EXPECT_EQ(cache.load_directory(dir.string(), "dump_*.json", 3), 11);
+    EXPECT_EQ(cache.load_directory(dir.string(), "empty.json"), 0);
+    EXPECT_THROW(cache.load_file((dir / "notes.txt").string()), std::runtime_error);
+    EXPECT_THROW(cache.load_file((dir / "missing.json").string()), std::exception);
+    cache.end_transaction();
+
+    EXPECT_EQ(cache.get_all_ids().size(), 10);
+    EXPECT_EQ(std::get<double>(cache.get_one("0", {"val"})[0]), 42.0);
+    EXPECT_EQ(std::get<double>(cache.get_one("104", {"val"})[0]), 4.0);
+
+    EXPECT_THROW(cache.load_directory(dir.string()), std::runtime_error); // no transaction
+    std::filesystem::remove_all(dir);
+}
+
+TEST_F(SmallCacheTest, PatchItem)
+{
+    std::vector<std::string> attrs = {"a", "b", "c", "d"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    cache.add_item("1", {{"a", 1.0}, {"c", "x"s}});
+    cache.add_item("2", {{"d", true}});
+    cache.end_transaction();
+
+    // overwrite in place, same shape
+    const auto* data_before = cache.cache.at("1").value.data();
+    EXPECT_TRUE(cache.patch_item("1", {{"a", 2.0}, {"unknown", 5.0}}));
+    EXPECT_EQ(cache.cache.at("1").value.data(), data_before);
+
+    // insert a slot in the middle, then remove one
+    EXPECT_TRUE(cache.patch_item("1", {{"b", std::vector<std::string>{"t"}}}));
+    EXPECT_TRUE(cache.patch_item("1", {{"a", std::monostate{}}, {"d", false}}));
+
+    auto res = cache.get_one("1", attrs);
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(res[0]));
+    EXPECT_EQ(std::get<std::vector<std::string>>(res[1]), std::vector<std::string>{"t"});
+    EXPECT_EQ(std::get<std::string>(res[2]), "x");
+    EXPECT_EQ(std::get<bool>(res[3]), false);
+    EXPECT_EQ(cache.cache.at("1").value.size(), 3);
+
+    // removing an absent attribute is a no-op
+    EXPECT_TRUE(cache.patch_item("2", {{"a", std::monostate{}}}));
+    EXPECT_EQ(cache.cache.at("2").value.size(), 1);
+
+    EXPECT_FALSE(cache.patch_item("missing", {{"a", 1.0}}));
+    EXPECT_EQ(cache.patch_many({{"1", {{"c", "y"s}}}, {"2", {{"a", 3.0}}}, {"missing", {{"a", 1.0}}}}), 2);
+    EXPECT_EQ(std::get<std::string>(cache.get_one("1", {"c"})[0]), "y");
+    EXPECT_EQ(std::get<double>(cache.get_one("2", {"a"})[0]), 3.0);
+    EXPECT_EQ(std::get<bool>(cache.get_one("2", {"d"})[0]), true);
+
+    // patches do not refresh items: an item only patched is still dropped by a removing transaction
+    cache.begin_transaction();
+    cache.add_item("2", {{"a", 4.0}});
+    EXPECT_TRUE(cache.patch_item("1", {{"a", 1.0}}));
+    cache.end_transaction();
+    EXPECT_EQ(cache.get_all_ids(), std::vector<std::string>{"2"});
+}
+
+TEST_F(SmallCacheTest, MemoryBudgetEviction)
+{
+    SmallCache cache({"val"});
+    cache.begin_transaction(0, false);
+    for (int i = 0; i < 100; ++i)
+        cache.add_item(std::to_string(i), {{"val", double(i)}});
+    cache.end_transaction();
+    EXPECT_EQ(cache.eviction_stats().tracked_bytes, 0); // not tracked without a budget
+
+    cache.set_memory_budget(1);
+    EXPECT_TRUE(cache.get_all_ids().empty());
+    EXPECT_EQ(cache.eviction_stats().evicted, 100);
+
+    // footprint of one item, measured on a separate cache
+    SmallCache probe({"val"});
+    probe.set_memory_budget(std::numeric_limits<size_t>::max());
+    probe.begin_transaction();
+    probe.add_item("p", {{"val", 1.0}});
+    probe.end_transaction();
+    const size_t per_item = probe.eviction_stats().tracked_bytes;
+    ASSERT_GT(per_item, 0);
+
+    SmallCache lru({"val"});
+    lru.set_memory_budget(per_item * 10);
+    lru.begin_transaction(100, false); // reserved up front so iteration order stays fixed
+    for (int i = 0; i < 11; ++i)
+        lru.add_item(std::to_string(i), {{"val", double(i)}});
+    // the 11th insert made the hand clear every CLOCK bit and evict one item
+    auto ids = lru.get_all_ids();
+    ASSERT_EQ(ids.size(), 10);
+    EXPECT_EQ(lru.eviction_stats().evicted, 1);
+
+    const std::vector<std::string> hot(ids.begin(), ids.begin() + 5);
+    for (const auto& id : hot)
+        lru.get_one(id, {"val"});
+    for (int i = 11; i < 16; ++i)
+        lru.add_item(std::to_string(i), {{"val", double(i)}});
+    lru.end_transaction();
+
+    const auto stats = lru.eviction_stats();
+    EXPECT_EQ(stats.evicted, 6);
+    EXPECT_LE(stats.tracked_bytes, stats.memory_budget);
+    EXPECT_EQ(lru.get_all_ids().size(), 10);
+    for (const auto& id : hot)
+        EXPECT_FALSE(lru.get_one(id, {"val"}).empty()) << id;
+}
+
+TEST_F(SmallCacheTest, ItemTtl)
+{
+    SmallCache cache({"val"});
+    cache.begin_transaction();
+    cache.add_item("short", {{"val", 1.0}}, 0.001);
+    cache.add_item("long", {{"val", 2.0}}, 3600);
+    cache.add_item("cleared", {{"val", 3.0}}, 0.001);
+    cache.add_item("plain", {{"val", 4.0}});
+    EXPECT_TRUE(cache.set_ttl("cleared", 0));
+    EXPECT_FALSE(cache.set_ttl("missing", 1));
+    cache.end_transaction();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // expired items are invisible before they are swept
+    EXPECT_TRUE(cache.get_one("short", {"val"}).empty());
+    EXPECT_EQ(cache.get_all_ids().size(), 3);
+    EXPECT_EQ(cache.cache.size(), 4);
+
+    EXPECT_EQ(cache.sweep_expired(), 1);
+    EXPECT_EQ(cache.cache.size(), 3);
+    EXPECT_EQ(cache.eviction_stats().expired, 1);
+    EXPECT_EQ(std::get<double>(cache.get_one("long", {"val"})[0]), 2.0);
+    EXPECT_EQ(std::get<double>(cache.get_one("cleared", {"val"})[0]), 3.0);
+
+    // re-adding with a new ttl replaces the old deadline
+    cache.begin_transaction(0, false);
+    cache.add_item("long", {{"val", 5.0}}, 0.001);
+    cache.end_transaction();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(cache.sweep_expired(), 1);
+    EXPECT_TRUE(cache.get_one("long", {"val"}).empty());
+
+    // re-adding or reloading without a ttl drops the old deadline; a patch keeps it
+    cache.begin_transaction(0, false);
+    cache.add_item("readded", {{"val", 6.0}}, 0.001);
+    cache.add_item("reloaded", {{"val", 7.0}}, 0.001);
+    cache.add_item("patched", {{"val", 8.0}}, 0.001);
+    cache.add_item("readded", {{"val", 6.5}});
+    cache.load_page(R"({"result": {"count": 1, "pagination": {"page": 1, "pages": 1}, "data": [
+        {"id": "reloaded", "attributes": [{"id": "val", "value": 7.5}]}]}})");
+    EXPECT_TRUE(cache.patch_item("patched", {{"val", 8.5}}));
+    cache.end_transaction();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(cache.sweep_expired(), 1);
+    EXPECT_EQ(std::get<double>(cache.get_one("readded", {"val"})[0]), 6.5);
+    EXPECT_EQ(std::get<double>(cache.get_one("reloaded", {"val"})[0]), 7.5);
+    EXPECT_TRUE(cache.get_one("patched", {"val"}).empty());
+
+    // refreshing one id over and over leaves stale deadlines behind, but only a bounded number
+    cache.begin_transaction(0, false);
+    for (int i = 0; i < 10000; ++i)
+    {
+        if (i % 2)
+            EXPECT_TRUE(cache.set_ttl("refreshed", 3600));
+        else
+            cache.add_item("refreshed", {{"val", double(i)}}, 3600);
+    }
+    cache.end_transaction();
+    EXPECT_LT(cache.eviction_stats().queued_deadlines, 100);
+    EXPECT_FALSE(cache.get_one("refreshed", {"val"}).empty());
+}
+
+TEST_F(SmallCacheTest, GetManyColumnar)
+{
+    std::vector<std::string> attrs = {"num", "flag", "name", "tags", "mixed", "none"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    cache.add_item("1", {{"num", 1.5}, {"flag", true}, {"name", "x"s}, {"tags", std::vector<std::string>{"t"}},
+                         {"mixed", 1.0}});
+    cache.add_item("2", {{"name", "x"s}, {"mixed", "s"s}, {"none", std::monostate{}}});
+    cache.add_item("3", {{"num", 3.0}, {"flag", false}});
+    cache.end_transaction();
+
+    using Kind = SmallCache::Column::Kind;
+    auto res = cache.get_many_columnar({"1", "missing", "2", "3"}, {"num", "flag", "name", "tags", "mixed", "none",
+                                                                    "unknown"});
+    EXPECT_EQ(res.found, (std::vector<uint8_t>{1, 0, 1, 1}));
+    ASSERT_EQ(res.columns.size(), 7);
+
+    const auto& num = res.columns[0];
+    EXPECT_EQ(num.kind, Kind::Double);
+    EXPECT_EQ(num.valid, (std::vector<uint8_t>{1, 0, 0, 1}));
+    ASSERT_EQ(num.doubles.size(), 4);
+    EXPECT_EQ(num.doubles[0], 1.5);
+    EXPECT_TRUE(std::isnan(num.doubles[1]));
+    EXPECT_EQ(num.doubles[3], 3.0);
+
+    const auto& flag = res.columns[1];
+    EXPECT_EQ(flag.kind, Kind::Bool);
+    EXPECT_EQ(flag.bools, (std::vector<uint8_t>{1, 0, 0, 0}));
+    EXPECT_EQ(flag.valid, (std::vector<uint8_t>{1, 0, 0, 1}));
+
+    const auto& name = res.columns[2];
+    EXPECT_EQ(name.kind, Kind::String);
+    ASSERT_EQ(name.strings.size(), 4);
+    EXPECT_EQ(&name.strings[0]->get(), &name.strings[2]->get()); // interned, shared
+    EXPECT_FALSE(name.strings[3].has_value());
+
+    EXPECT_EQ(res.columns[3].kind, Kind::Object);
+    EXPECT_EQ(std::get<std::vector<std::string>>(res.columns[3].objects[0]), std::vector<std::string>{"t"});
+
+    const auto& mixed = res.columns[4];
+    EXPECT_EQ(mixed.kind, Kind::Object);
+    EXPECT_EQ(std::get<double>(mixed.objects[0]), 1.0);
+    EXPECT_EQ(std::get<std::string>(mixed.objects[2]), "s");
+    EXPECT_EQ(mixed.valid, (std::vector<uint8_t>{1, 0, 1, 0}));
+
+    EXPECT_EQ(res.columns[5].kind, Kind::Empty); // stored None counts as missing
+    EXPECT_EQ(res.columns[6].kind, Kind::Empty);
+    EXPECT_EQ(res.columns[6].valid, (std::vector<uint8_t>{0, 0, 0, 0}));
+}
+
+TEST_F(SmallCacheTest, Scan)
+{
+    using Filter = SmallCache::Filter;
+    using Op = Filter::Op;
+    std::vector<std::string> attrs = {"color", "price", "tags", "active"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    for (int i = 0; i < 10000; ++i)
+    {
+        std::unordered_map<std::string, SmallCache::pyAttrValue> item = {
+            {"color", i % 3 == 0 ? "red"s : i % 3 == 1 ? "green"s : "blue"s},
+            {"price", double(i)},
+        };
+        if (i % 2 == 0)
+            item["tags"] = std::vector<std::string>{"even", i % 4 == 0 ? "four" : "two"};
+        if (i < 10)
+            item["active"] = true;
+        cache.add_item(std::to_string(i), item);
+    }
+    cache.end_transaction();
+
+    const auto count = [&](const Filter& f, size_t threads = 4) { return cache.scan(f, {}, 0, threads).size(); };
+
+    EXPECT_EQ(count({.op = Op::Eq, .attribute = "color", .values = {"red"s}}), 3334);
+    EXPECT_EQ(count({.op = Op::Eq, .attribute = "color", .values = {"red"s}}, 1), 3334);
+    EXPECT_EQ(count({.op = Op::Ne, .attribute = "color", .values = {"red"s}}), 6666);
+    EXPECT_EQ(count({.op = Op::Lt, .attribute = "price", .values = {100.0}}), 100);
+    EXPECT_EQ(count({.op = Op::Gt, .attribute = "price", .values = {9989.0}}), 10);
+    EXPECT_EQ(count({.op = Op::In, .attribute = "color", .values = {"red"s, "blue"s, "purple"s}}), 6667);
+    EXPECT_EQ(count({.op = Op::In, .attribute = "price", .values = {1.0, 2.0, -5.0}}), 2);
+    EXPECT_EQ(count({.op = Op::Contains, .attribute = "tags", .values = {"four"s}}), 2500);
+    EXPECT_EQ(count({.op = Op::Has, .attribute = "active"}), 10);
+    EXPECT_EQ(count({.op = Op::Has, .attribute = "unknown"}), 0);
+    EXPECT_EQ(count({.op = Op::Eq, .attribute = "color", .values = {"never-seen"s}}), 0);
+    EXPECT_EQ(count({.op = Op::And, .children = {
+                         {.op = Op::Eq, .attribute = "color", .values = {"red"s}},
+                         {.op = Op::Lt, .attribute = "price", .values = {30.0}}}}), 10);
+    EXPECT_EQ(count({.op = Op::Or, .children = {
+                         {.op = Op::Has, .attribute = "active"},
+                         {.op = Op::Gt, .attribute = "price", .values = {9994.0}}}}), 15);
+    EXPECT_THROW(count({.op = Op::Eq, .attribute = "color"}), std::runtime_error);
+    EXPECT_THROW(count({.op = Op::Contains, .attribute = "tags", .values = {1.0}}), std::runtime_error);
+
+    auto rows = cache.scan({.op = Op::Lt, .attribute = "price", .values = {3.0}}, {"price", "color", "nope"});
+    std::ranges::sort(rows);
+    ASSERT_EQ(rows.size(), 3);
+    EXPECT_EQ(rows[0].first, "0");
+    EXPECT_EQ(std::get<double>(rows[0].second[0]), 0.0);
+    EXPECT_EQ(std::get<std::string>(rows[0].second[1]), "red");
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(rows[0].second[2]));
+
+    EXPECT_EQ(cache.scan({.op = Op::Has, .attribute = "price"}, {}, 7, 4).size(), 7);
+}
+
+TEST_F(SmallCacheTest, Aggregate)
+{
+    using Metric = SmallCache::Metric;
+    std::vector<std::string> attrs = {"color", "price", "size"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::unordered_map<std::string, SmallCache::pyAttrValue> item = {
+            {"color", i % 2 == 0 ? "red"s : "blue"s},
+            {"size", i % 5 == 0 ? "S"s : "M"s},
+        };
+        if (i % 4 != 3)
+            item["price"] = double(i);
+        cache.add_item(std::to_string(i), item);
+    }
+    cache.add_item("nocolor", {{"price", 1.5}});
+    cache.end_transaction();
+
+    const std::vector metrics = {Metric::parse("count"), Metric::parse("count(price)"), Metric::parse("sum(price)"),
+                                 Metric::parse("min(price)"), Metric::parse("max(price)"),
+                                 Metric::parse("count_distinct(size)")};
+    for (size_t threads : {1, 4})
+    {
+        auto rows = cache.aggregate({"color"}, metrics, threads);
+        ASSERT_EQ(rows.size(), 3);
+        std::ranges::sort(rows, {}, [](const auto& row) { return row.key; });
+        EXPECT_TRUE(std::holds_alternative<std::monostate>(rows[0].key[0]));
+        EXPECT_EQ(rows[0].values[0], 1.0);
+        EXPECT_EQ(rows[0].values[2], 1.5);
+        EXPECT_EQ(rows[0].values[5], 0.0);
+
+        EXPECT_EQ(std::get<std::string>(rows[1].key[0]), "blue");
+        EXPECT_EQ(rows[1].values[0], 10000.0);
+        EXPECT_EQ(rows[1].values[1], 5000.0); // odd i, minus i % 4 == 3
+        EXPECT_EQ(rows[1].values[3], 1.0);
+        EXPECT_EQ(rows[1].values[4], 19997.0);
+        EXPECT_EQ(rows[1].values[5], 2.0);
+
+        EXPECT_EQ(std::get<std::string>(rows[2].key[0]), "red");
+        EXPECT_EQ(rows[2].values[1], 10000.0);
+        EXPECT_EQ(rows[2].values[2], 99990000.0); // 0 + 2 + ... + 19998
+    }
+
+    const auto bySize = cache.aggregate({"size", "unknown"}, {Metric::parse("count")});
+    EXPECT_EQ(bySize.size(), 3);
+    const auto all = cache.aggregate({}, {Metric::parse("count"), Metric::parse("min(color)")});
+    ASSERT_EQ(all.size(), 1);
+    EXPECT_EQ(all[0].values[0], 20001.0);
+    EXPECT_FALSE(all[0].values[1].has_value());
+
+    EXPECT_THROW(Metric::parse("median(price)"), std::runtime_error);
+    EXPECT_THROW(Metric::parse("sum"), std::runtime_error);
+    EXPECT_THROW(Metric::parse("sum(price"), std::runtime_error);
+}
+
+TEST_F(SmallCacheTest, IdCursor)
+{
+    std::vector<std::string> attrs = {"a"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    for (int i = 0; i < 1000; ++i)
+        cache.add_item(std::to_string(i), {{"a", double(i)}});
+    cache.add_item("short-lived", {{"a", 1.0}}, 0.01);
+    cache.end_transaction();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(cache.ids_count(), 1000);
+
+    auto cursor = cache.id_cursor(300);
+    std::vector<std::string> ids;
+    std::vector<size_t> sizes;
+    for (auto chunk = cursor.next_chunk(); !chunk.empty(); chunk = cursor.next_chunk())
+    {
+        sizes.push_back(chunk.size());
+        ids.insert(ids.end(), chunk.begin(), chunk.end());
+    }
+    EXPECT_TRUE(cursor.exhausted());
+    EXPECT_EQ(sizes, (std::vector<size_t>{300, 300, 300, 100}));
+    auto all = cache.get_all_ids();
+    std::ranges::sort(ids);
+    std::ranges::sort(all);
+    EXPECT_EQ(ids, all);
+
+    EXPECT_EQ(cache.sweep_expired(), 1);
+    auto reads = cache.id_cursor(10);
+    EXPECT_EQ(reads.next_chunk().size(), 10);
+    cache.get_one("5", attrs);
+    cache.patch_item("5", {{"a", 6.0}});
+    EXPECT_EQ(reads.next_chunk().size(), 10);
+
+    cache.begin_transaction(0, false);
+    cache.add_item("new", {{"a", 1.0}});
+    cache.end_transaction();
+    EXPECT_THROW(reads.next_chunk(), std::runtime_error);
+    EXPECT_THROW(cache.id_cursor(0), std::runtime_error);
+
+    // reserving room rebuilds the table whether or not the bucket count grows
+    auto reserved = cache.id_cursor(10);
+    cache.begin_transaction();
+    cache.end_transaction();
+    EXPECT_EQ(reserved.next_chunk().size(), 10);
+    cache.begin_transaction(cache.cache.size() + 1);
+    EXPECT_THROW(reserved.next_chunk(), std::runtime_error);
+    cache.end_transaction();
+
+    // so does a page announcing more items than the cache holds
+    auto paged = cache.id_cursor(10);
+    EXPECT_EQ(paged.next_chunk().size(), 10);
+    cache.begin_transaction(0, false);
+    cache.load_page(std::format(R"({{"result": {{"count": {}, "pagination": {{"page": 1, "pages": 1}}, "data": []}}}})",
+                                cache.cache.size() + 1));
+    cache.end_transaction();
+    EXPECT_THROW(paged.next_chunk(), std::runtime_error);
+}
+
+TEST_F(SmallCacheTest, AddAndDropAttributes)
+{
+    std::vector<std::string> attrs = {"a", "b"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    cache.add_item("1", {{"a", 1.0}, {"b", "x"s}, {"c", true}});
+    cache.add_item("2", {{"a", 2.0}});
+    cache.end_transaction();
+
+    EXPECT_TRUE(cache.add_attribute("c"));
+    EXPECT_FALSE(cache.add_attribute("c"));
+    EXPECT_EQ(cache.numberOfAttributes, 3);
+    auto values = cache.get_one("1", {"a", "b", "c"});
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(values[2]));
+    cache.patch_item("1", {{"c", true}});
+    EXPECT_EQ(std::get<bool>(cache.get_one("1", {"c"})[0]), true);
+
+    EXPECT_TRUE(cache.drop_attribute("a"));
+    EXPECT_FALSE(cache.drop_attribute("a"));
+    values = cache.get_one("1", {"a", "b", "c"});
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(values[0]));
+    EXPECT_EQ(std::get<std::string>(values[1]), "x");
+    EXPECT_EQ(std::get<bool>(values[2]), true);
+    // item 1 is reclaimed by its patch, item 2 only by compaction
+    cache.patch_item("1", {{"b", "y"s}});
+    EXPECT_EQ(cache.cache.at("1").value.size(), 2);
+    EXPECT_EQ(cache.cache.at("2").value.size(), 1);
+    EXPECT_EQ(cache.compact_attributes(), 1);
+    EXPECT_TRUE(cache.cache.at("2").value.empty());
+
+    // the compacted index is reused, and no stale value shows through it
+    EXPECT_TRUE(cache.add_attribute("d"));
+    EXPECT_EQ(cache.numberOfAttributes, 3);
+    EXPECT_EQ(cache.attrMap.at("d"), 0);
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(cache.get_one("2", {"d"})[0]));
+
+    cache.begin_transaction();
+    cache.add_item("1", {{"d", 4.0}, {"a", 1.0}});
+    cache.end_transaction();
+    values = cache.get_one("1", {"a", "b", "d"});
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(values[0]));
+    EXPECT_EQ(std::get<double>(values[2]), 4.0);
+    EXPECT_EQ(cache.get_all_ids(), std::vector<std::string>{"1"});
+
+    SmallCache full(std::vector<std::string>(SmallCache::MarkedItem::maxAttributes, "x"));
+    EXPECT_FALSE(full.add_attribute("x"));
+    EXPECT_THROW(full.add_attribute("y"), std::runtime_error);
+}
+
+TEST_F(SmallCacheTest, OrderedIdIndex)
+{
+    std::vector<std::string> attrs = {"n"};
+    SmallCache cache(attrs);
+    EXPECT_THROW(cache.prefix_scan("a", attrs), std::runtime_error);
+    cache.set_ordered_index(true);
+    EXPECT_TRUE(cache.has_ordered_index());
+
+    cache.begin_transaction();
+    std::vector<std::string> ids;
+    for (int tenant = 0; tenant < 10; ++tenant)
+    {
+        for (int sku = 0; sku < 100; ++sku)
+        {
+            ids.push_back(std::format("tenant{}:category{}:sku{:03}", tenant, sku % 3, sku));
+            cache.add_item(ids.back(), {{"n", double(sku)}});
+        }
+    }
+    cache.end_transaction();
+    std::ranges::sort(ids);
+
+    const auto keys = [](const std::vector<SmallCache::Row>& rows)
+    {
+        std::vector<std::string> out;
+        for (const auto& row : rows)
+            out.push_back(row.first);
+        return out;
+    };
+
+    auto rows = cache.prefix_scan("tenant3:", attrs);
+    ASSERT_EQ(rows.size(), 100);
+    EXPECT_TRUE(std::ranges::is_sorted(keys(rows)));
+    EXPECT_TRUE(std::ranges::all_of(keys(rows), [](const auto& k) { return k.starts_with("tenant3:"); }));
+    EXPECT_EQ(cache.prefix_scan("tenant3:category1:", attrs).size(), 33);
+    EXPECT_EQ(cache.prefix_scan("", attrs).size(), 1000);
+    EXPECT_TRUE(cache.prefix_scan("tenant99", attrs).empty());
+    EXPECT_TRUE(cache.prefix_scan("zzz", attrs).empty());
+    EXPECT_EQ(cache.prefix_scan("tenant5:", attrs, 7).size(), 7);
+
+    rows = cache.range_scan(ids[17], ids[342], {"n"});
+    EXPECT_EQ(keys(rows), std::vector(ids.begin() + 17, ids.begin() + 342));
+    EXPECT_EQ(std::get<double>(rows[0].second[0]), 17.0);
+    EXPECT_EQ(cache.range_scan("tenant9", std::nullopt, attrs).size(), 100);
+    EXPECT_EQ(cache.range_scan("a", "b", attrs).size(), 0);
+
+    // ids added by an open transaction become visible once it ends
+    cache.begin_transaction(0, false);
+    cache.add_item("tenant3:new", {{"n", 1.0}});
+    EXPECT_EQ(cache.prefix_scan("tenant3:", attrs).size(), 100);
+    cache.end_transaction();
+    EXPECT_EQ(cache.prefix_scan("tenant3:", attrs).size(), 101);
+    cache.begin_transaction();
+    cache.add_item("tenant3:new", {{"n", 1.0}});
+    cache.end_transaction();
+    EXPECT_EQ(keys(cache.prefix_scan("tenant", attrs)), std::vector<std::string>{"tenant3:new"});
+
+    cache.set_ordered_index(false);
+    EXPECT_THROW(cache.range_scan("a", "b", attrs), std::runtime_error);
+}
+
+TEST_F(SmallCacheTest, SharedSegment)
+{
+    const auto name = std::format("small_cache_test_{}", std::chrono::steady_clock::now().time_since_epoch().count());
+    std::vector<std::string> attrs = {"num", "flag", "name", "tags"};
+    SmallCache cache(attrs);
+    cache.begin_transaction();
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::unordered_map<std::string, SmallCache::pyAttrValue> item = {
+            {"num", double(i)},
+            {"name", i % 2 ? "odd"s : "even"s},
+        };
+        if (i % 3 == 0)
+            item["flag"] = i % 2 == 0;
+        if (i % 5 == 0)
+            item["tags"] = std::vector<std::string>{"a", std::to_string(i % 7)};
+        cache.add_item(std::to_string(i), item);
+    }
+    cache.end_transaction();
+
+    EXPECT_THROW(SharedCacheReader{name}, std::runtime_error);
+    EXPECT_EQ(cache.publish_shared(name), 1);
+    SharedCacheReader reader(name);
+    EXPECT_EQ(reader.generation(), 1);
+    EXPECT_EQ(reader.size(), 1000);
+    EXPECT_EQ(reader.attributes(), attrs);
+
+    const std::vector<std::string> query = {"tags", "flag", "num", "name", "unknown"};
+    for (int i = 0; i < 1000; ++i)
+    {
+        const auto id = std::to_string(i);
+        EXPECT_EQ(reader.get_one(id, query), cache.get_one(id, query)) << id;
+    }
+    EXPECT_TRUE(reader.get_one("missing", query).empty());
+    const auto many = reader.get_many({"3", "missing", "10"}, {"num"});
+    ASSERT_EQ(many.size(), 3);
+    EXPECT_EQ(std::get<double>(many[0][0]), 3.0);
+    EXPECT_TRUE(many[1].empty());
+    EXPECT_EQ(std::get<double>(many[2][0]), 10.0);
+
+    // a new generation replaces the old one on the reader's next lookup
+    cache.begin_transaction();
+    cache.add_item("only", {{"num", 42.0}});
+    cache.end_transaction();
+    EXPECT_EQ(cache.publish_shared(name), 2);
+    EXPECT_EQ(reader.generation(), 1);
+    EXPECT_EQ(std::get<double>(reader.get_one("only", {"num"})[0]), 42.0);
+    EXPECT_EQ(reader.generation(), 2);
+    EXPECT_EQ(reader.size(), 1);
+    EXPECT_TRUE(reader.get_one("3", {"num"}).empty());
+    EXPECT_FALSE(reader.refresh());
+
+    // one reader shared by threads while new generations replace the mapping under them
+    std::atomic<bool> done{false};
+    std::atomic<int> wrong{0};
+    {
+        std::vector<std::jthread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&]
+            {
+                while (!done.load())
+                {
+                    const auto row = reader.get_one("only", {"num"});
+                    if (row.size() != 1 || std::get<double>(row[0]) < 42.0)
+                        wrong.fetch_add(1);
+                }
+            });
+        }
+        for (int g = 1; g <= 20; ++g)
+        {
+            cache.begin_transaction();
+            cache.add_item("only", {{"num", 42.0 + g}});
+            cache.end_transaction();
+            cache.publish_shared(name);
+        }
+        done = true;
+    }
+    EXPECT_EQ(wrong.load(), 0);
+    EXPECT_EQ(std::get<double>(reader.get_one("only", {"num"})[0]), 62.0);
+    EXPECT_EQ(reader.generation(), 22);
+
+    // concurrent publishers each get their own generation; the newest one stays visible
+    {
+        std::vector<std::jthread> publishers;
+        for (int t = 0; t < 4; ++t)
+            publishers.emplace_back([&]
+            {
+                for (int i = 0; i < 10; ++i)
+                    EXPECT_GE(cache.publish_shared(name), 23);
+            });
+    }
+    EXPECT_EQ(std::get<double>(reader.get_one("only", {"num"})[0]), 62.0);
+    EXPECT_EQ(reader.generation(), 62);
+    EXPECT_EQ(SharedCacheReader(name).size(), 1);
+
+    SmallCache::remove_shared(name);
+    EXPECT_THROW(SharedCacheReader{name}, std::runtime_error);
+}
+
+TEST_F(SmallCacheTest, TypedSmallCache)
+{
+    using typed_schema::Field;
+    using Product = typed_schema::Schema<Field<"price", double>, Field<"active", bool>, Field<"label", std::string>,
+                                         Field<"tags", std::vector<std::string>>>;
+    static_assert(Product::index_of<"label">() == 2);
+    static_assert(Product::lookup.find("tags") == 3);
+    static_assert(!Product::lookup.find("tag").has_value());
+    static_assert(std::is_same_v<Product::Mask, uint8_t>);
+
+    const std::string page = R"({"result": {"count": 3, "pagination": {"page": 1, "pages": 4}, "data": [
+        {"id": "1", "attributes": [{"id": "price", "value": 9.5}, {"id": "label", "value": "first"},
+                                   {"id": "tags", "value": ["a", "b"]}, {"id": "other", "value": 1}]},
+        {"id": "2", "attributes": [{"id": "act\u0069ve", "value": true}, {"id": "label", "value": null}]},
+        {"id": "3", "attributes": []}]}})";
+
+    TypedSmallCache<Product> typed;
+    SmallCache dynamic({"price", "active", "label", "tags"});
+    typed.begin_transaction();
+    dynamic.begin_transaction();
+    EXPECT_EQ(typed.load_page(page), 4);
+    EXPECT_EQ(dynamic.load_page(page), 4);
+    typed.end_transaction();
+    dynamic.end_transaction();
+    EXPECT_EQ(typed.size(), 3);
+
+    const auto* first = typed.find("1");
+    ASSERT_NE(first, nullptr);
+    EXPECT_EQ(*first->get<"price">(), 9.5);
+    EXPECT_EQ(first->get<"label">()->get(), "first");
+    EXPECT_EQ(first->get<"tags">()->get().size(), 2);
+    EXPECT_EQ(first->get<"active">(), nullptr);
+    EXPECT_EQ(typed.find("2")->get<"label">(), nullptr);
+    ASSERT_NE(typed.find("2")->get<"active">(), nullptr); // attribute names are unescaped before the lookup
+    EXPECT_TRUE(*typed.find("2")->get<"active">());
+    EXPECT_EQ(typed.find("missing"), nullptr);
+
+    const std::vector<std::string> attributes = {"price", "active", "label", "tags", "unknown"};
+    for (const auto* id : {"1", "2", "3", "missing"})
+    {
+        auto expected = dynamic.get_one(id, attributes);
+        if (std::string_view(id) == "2")
+            expected[2] = std::monostate{}; // the dynamic cache keeps null strings as ""
+        EXPECT_EQ(typed.get_one(id, attributes), expected) << id;
+    }
+    // list elements keep their raw JSON text, as in SmallCache
+    EXPECT_EQ(std::get<std::vector<std::string>>(typed.get_one("1", {"tags"})[0]),
+              (std::vector<std::string>{R"("a")", R"("b")"}));
+
+    // items can also be built directly; a refresh drops what it did not see
+    typed.begin_transaction();
+    typed.add_item("4", TypedSmallCache<Product>::Item{}.set<"price">(1.0).set<"tags">(std::vector<std::string>{"x"}));
+    typed.end_transaction();
+    EXPECT_EQ(typed.size(), 1);
+    EXPECT_EQ(*typed.find("4")->get<"price">(), 1.0);
+
+    typed.begin_transaction();
+    EXPECT_THROW(typed.load_page(R"({"result": {"data": [{"id": "5", "attributes": [{"id": "price", "value": "x"}]}]}})"),
+                 std::runtime_error);
+    EXPECT_THROW(typed.load_page(R"({"result": {"data": [{"id": "5", "attributes": [{"id": "tags", "value": "x"}]}]}})"),
+                 std::runtime_error);
+    EXPECT_THROW(typed.begin_transaction(), std::runtime_error);
+    typed.end_transaction();
+}
+
+TEST_F(SmallCacheTest, AddMany)
+{
+    std::vector<std::string> attrs = {"num", "name", "tags"};
+    SmallCache cache(attrs);
+    std::vector<std::vector<SmallCache::pyAttrValue>> rows = {
+        {1.0, "x"s, std::monostate{}, true},
+        {std::monostate{}, "y"s, std::vector<std::string>{"a", "b"}, false},
+    };
+    EXPECT_THROW(cache.add_many({"1", "2"}, {"num", "name", "tags", "unknown"}, std::move(rows)), std::runtime_error);
+
+    cache.begin_transaction();
+    rows = {
+        {1.0, "x"s, std::monostate{}, true},
+        {std::monostate{}, "y"s, std::vector<std::string>{"a", "b"}, false},
+    };
+    EXPECT_EQ(cache.add_many({"1", "2"}, {"num", "name", "tags", "unknown"}, std::move(rows)), 2);
+    EXPECT_THROW(cache.add_many({"3"}, {"num"}, {}), std::runtime_error);
+    EXPECT_THROW(cache.add_many({"3"}, {"num"}, {{1.0, 2.0}}), std::runtime_error);
+    // a malformed row anywhere in the batch rejects all of it
+    EXPECT_THROW(cache.add_many({"3", "4"}, {"num"}, {{3.0}, {4.0, 5.0}}), std::runtime_error);
+    EXPECT_EQ(cache.cache.count("3"), 0);
+    EXPECT_THROW(cache.add_many_flat({"3", "4"}, {"num"}, {3.0}), std::runtime_error);
+    EXPECT_EQ(cache.cache.count("3"), 0);
+    EXPECT_EQ(cache.add_many_flat({"5", "6"}, {"num", "name"}, {5.0, "five"s, std::monostate{}, "six"s}), 2);
+    EXPECT_EQ(cache.get_one("6", {"num", "name"}), (std::vector<SmallCache::pyAttrValue>{std::monostate{}, "six"s}));
+    // same result as the equivalent add_item calls
+    cache.add_item("1b", {{"num", 1.0}, {"name", "x"s}});
+    cache.add_item("2b", {{"name", "y"s}, {"tags", std::vector<std::string>{"a", "b"}}});
+    cache.end_transaction();
+
+    EXPECT_EQ(cache.get_one("1", attrs), cache.get_one("1b", attrs));
+    EXPECT_EQ(cache.get_one("2", attrs), cache.get_one("2b", attrs));
+    EXPECT_EQ(cache.cache.at("1").value.size(), 2);
+
+    // a batch rewrites whole items, like add_item
+    cache.begin_transaction(0, false);
+    cache.add_many({"1"}, {"tags"}, {{std::vector<std::string>{"c"}}});
+    cache.end_transaction();
+    const auto values = cache.get_one("1", attrs);
+    EXPECT_TRUE(std::holds_alternative<std::monostate>(values[0]));
+    EXPECT_EQ(std::get<std::vector<std::string>>(values[2]), std::vector<std::string>{"c"});
+}
+
+TEST_F(SmallCacheTest, ConcurrentReadersAndWriter)
+{
+    std::vector<std::string> attrs = {"a", "b"};
+    SmallCache cache(attrs);
+    constexpr int items = 200;
+    const auto page = [&](int round)
+    {
+        std::string data;
+        for (int i = 0; i < items; ++i)
+        {
+            data += std::format(R"({}{{"id": "{}", "attributes": [{{"id": "a", "value": {}}}, {{"id": "b", "value": {}}}]}})",
+                                i ? "," : "", i, round, round);
+        }
+        return std::format(R"({{"result": {{"count": {}, "pagination": {{"page": 1, "pages": 1}}, "data": [{}]}}}})",
+                           items, data);
+    };
+    cache.begin_transaction();
+    cache.load_page(page(0));
+    cache.end_transaction();
+
+    // every write replaces a and b together, so a reader must never see them differ
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::vector<std::jthread> readers;
+    for (int t = 0; t < 4; ++t)
+    {
+        readers.emplace_back([&, t]
+        {
+            std::vector<std::string> ids;
+            for (int i = t; i < items; i += 4)
+                ids.push_back(std::to_string(i));
+            while (!done.load())
+            {
+                for (const auto& row : cache.get_many(ids, attrs))
+                {
+                    if (row.empty() || row[0] != row[1])
+                        torn.fetch_add(1);
+                }
+                const auto one = cache.get_one(ids.front(), attrs);
+                if (one.empty() || one[0] != one[1])
+                    torn.fetch_add(1);
+            }
+        });
+    }
+    for (int round = 1; round <= 50; ++round)
+    {
+        cache.begin_transaction(items);
+        cache.load_page(page(round));
+        cache.end_transaction();
+    }
+    done = true;
+    readers.clear();
+
+    EXPECT_EQ(torn.load(), 0);
+    EXPECT_EQ(cache.ids_count(), items);
+    EXPECT_EQ(std::get<double>(cache.get_one("7", attrs)[0]), 50.0);
+}
+
+TEST_F(SmallCacheTest, TransactionLog)
+{
+    std::vector<std::string> attrs = {"num", "name", "tags", "flag"};
+    SmallCache source(attrs);
+    source.enable_transaction_log();
+    source.begin_transaction();
+    source.add_item("1", {{"num", 1.0}, {"name", "x"s}, {"tags", std::vector<std::string>{"a", "b"}}});
+    source.add_item("2", {{"name", "x"s}, {"flag", true}, {"tags", std::vector<std::string>{"a", "b"}}});
+    source.add_item("3", {{"num", 3.0}});
+    source.end_transaction();
+    source.patch_item("1", {{"num", 10.0}, {"name", std::monostate{}}});
+    source.begin_transaction();
+    source.add_item("1", {{"num", 11.0}, {"flag", false}});
+    source.add_item("4", {{"name", "y"s}});
+    source.end_transaction(); // drops 2 and 3
+
+    const auto log = source.take_transaction_log();
+    EXPECT_TRUE(source.take_transaction_log().empty());
+
+    // the replica orders its attributes differently and does not know "flag"
+    std::vector<std::string> replicaAttrs = {"tags", "name", "num"};
+    SmallCache replica(replicaAttrs);
+    EXPECT_EQ(replica.apply_log(log), 3);
+    EXPECT_FALSE(replica.transactionOpened);
+    const std::vector<std::string> ids = {"1", "2", "3", "4"};
+    const std::vector<std::string> common = {"num", "name", "tags"};
+    EXPECT_EQ(replica.get_many(ids, common), source.get_many(ids, common));
+    EXPECT_EQ(replica.ids_count(), 2);
+
+    // a replica can keep a log of its own for the next one down the line
+    SmallCache chained(attrs);
+    chained.enable_transaction_log();
+    EXPECT_EQ(chained.apply_log(log), 3);
+    SmallCache second(attrs);
+    EXPECT_EQ(second.apply_log(chained.take_transaction_log()), 3);
+    EXPECT_EQ(second.get_many(ids, attrs), source.get_many(ids, attrs));
+
+    // a file sink receives complete frames only
+    const auto path = std::filesystem::temp_directory_path() / "small_cache_test.log";
+    std::filesystem::remove(path);
+    source.disable_transaction_log();
+    source.enable_transaction_log(path.string());
+    source.begin_transaction(0, false);
+    source.add_item("5", {{"tags", std::vector<std::string>{"a", "b"}}});
+    EXPECT_EQ(std::filesystem::file_size(path), 0);
+    source.end_transaction();
+    source.disable_transaction_log();
+    EXPECT_EQ(replica.apply_log_file(path.string()), 1);
+    EXPECT_EQ(replica.get_one("5", {"tags"}), source.get_one("5", {"tags"}));
+    std::filesystem::remove(path);
+
+    // a log read in pieces, as from a pipe, splits into the same frames whatever the pieces are
+    {
+        SmallCache streamed(attrs);
+        transaction_log::FrameScanner scanner;
+        size_t start = 0;
+        size_t frames = 0;
+        for (size_t received = 1; received <= log.size(); ++received)
+        {
+            if (const auto size = scanner.next(std::string_view(log).substr(start, received - start)))
+            {
+                EXPECT_EQ(start + size, received);
+                frames += streamed.apply_log(std::string_view(log).substr(start, size));
+                start += size;
+            }
+        }
+        EXPECT_EQ(start, log.size());
+        EXPECT_EQ(frames, 3);
+        EXPECT_EQ(streamed.get_many(ids, attrs), source.get_many(ids, attrs));
+        EXPECT_EQ(transaction_log::FrameScanner{}.next("\x09"), 1);
+    }
+
+    // frames nobody takes are dropped past the limit, and the gap is reported once
+    SmallCache bounded(attrs);
+    bounded.enable_transaction_log({}, 64);
+    bounded.begin_transaction();
+    bounded.add_item("1", {{"num", 1.0}});
+    bounded.end_transaction();
+    EXPECT_FALSE(bounded.take_transaction_log().empty());
+    for (int i = 0; i < 10; ++i)
+        bounded.patch_item("1", {{"name", std::string(20, 'x')}});
+    EXPECT_THROW(bounded.take_transaction_log(), std::runtime_error);
+    bounded.patch_item("1", {{"num", 2.0}});
+    SmallCache resumed(attrs);
+    EXPECT_EQ(resumed.apply_log(bounded.take_transaction_log()), 1);
+
+    SmallCache broken(attrs);
+    EXPECT_THROW(broken.apply_log(std::string_view(log).substr(0, log.size() - 1)), std::runtime_error);
+    EXPECT_FALSE(broken.transactionOpened);
+    EXPECT_THROW(broken.apply_log("\x09"), std::runtime_error);
+    source.begin_transaction();
+    EXPECT_THROW(source.enable_transaction_log(), std::runtime_error);
+    source.end_transaction();
+}
@@ -4,33 +4,483 @@
 #include <nanobind/stl/vector.h>
 #include <nanobind/stl/optional.h>
 #include <nanobind/stl/unordered_map.h>
+#include <nanobind/stl/pair.h>
+#include <nanobind/ndarray.h>
 #include <tsl/sparse_map.h>
 #include <absl/hash/hash.h>
 #include <absl/container/flat_hash_map.h>
 #include <boost/flyweight.hpp>
 #include <optional>
+#include <cmath>
 #include <algorithm>
 #include <variant>
 #include <vector>
 #include <string>
 #include <glaze/glaze.hpp>
 #include "SmallCache.h"
+#include "SharedSegment.h"
 
 namespace nb = nanobind;
 using namespace nb::literals;
 
+namespace
+{
+    // Read-only view of a str or any buffer-protocol object (bytes, bytearray, memoryview, mmap, ...),
+    // so that JSON payloads can be parsed in place without copying them into a std::string.
+    class TextBuffer
+    {
+    public:
+        explicit TextBuffer(nb::handle obj)
+        {
+            if (PyUnicode_Check(obj.ptr()))
+            {
+                Py_ssize_t size = 0;
+                const char* data = PyUnicode_AsUTF8AndSize(obj.ptr(), &size);
+                if (!data)
+                    nb::raise_python_error();
+                text = {data, static_cast<size_t>(size)};
+                return;
+            }
+            if (PyObject_GetBuffer(obj.ptr(), &buffer, PyBUF_SIMPLE) != 0)
+                nb::raise_python_error();
+            hasBuffer = true;
+            text = {static_cast<const char*>(buffer.buf), static_cast<size_t>(buffer.len)};
+        }
+
+        ~TextBuffer()
+        {
+            if (hasBuffer)
+                PyBuffer_Release(&buffer);
+        }
+
+        TextBuffer(const TextBuffer&) = delete;
+        TextBuffer& operator=(const TextBuffer&) = delete;
+
+        [[nodiscard]] std::string_view view() const noexcept { return text; }
+
+    private:
+        Py_buffer buffer{};
+        bool hasBuffer = false;
+        std::string_view text;
+    };
+
+    // Hands a vector over to NumPy without copying; the capsule frees it with the array.
+    template <class T, class Elem = T>
+    nb::ndarray<nb::numpy, Elem, nb::ndim<1>> to_numpy(std::vector<T>&& values)
+    {
+        auto* heap = new std::vector<T>(std::move(values));
+        nb::capsule owner(heap, [](void* p) noexcept { delete static_cast<std::vector<T>*>(p); });
+        return nb::ndarray<nb::numpy, Elem, nb::ndim<1>>(reinterpret_cast<Elem*>(heap->data()), {heap->size()}, owner);
+    }
+
+    nb::dict columnar_to_dict(const std::vector<std::string>& attributes, SmallCache::ColumnarResult&& result)
+    {
+        using Kind = SmallCache::Column::Kind;
+        nb::dict columns, valid;
+        // one Python str per distinct interned string, shared by every cell holding it
+        absl::flat_hash_map<const std::string*, nb::object> interned;
+        for (size_t a = 0; a < attributes.size(); ++a)
+        {
+            auto& column = result.columns[a];
+            const auto rows = column.valid.size();
+            nb::object out;
+            switch (column.kind)
+            {
+            case Kind::Double:
+                out = nb::cast(to_numpy(std::move(column.doubles)));
+                break;
+            case Kind::Bool:
+                out = nb::cast(to_numpy<uint8_t, bool>(std::move(column.bools)));
+                break;
+            case Kind::String:
+                {
+                    nb::list list;
+                    for (const auto& cell : column.strings)
+                    {
+                        if (!cell)
+                        {
+                            list.append(nb::none());
+                            continue;
+                        }
+                        const std::string& s = cell->get();
+                        auto [it, inserted] = interned.try_emplace(&s);
+                        if (inserted)
+                            it->second = nb::str(s.data(), s.size());
+                        list.append(it->second);
+                    }
+                    out = std::move(list);
+                    break;
+                }
+            case Kind::Object:
+                out = nb::cast(std::move(column.objects));
+                break;
+            case Kind::Empty:
+                {
+                    nb::list list;
+                    for (size_t i = 0; i < rows; ++i)
+                        list.append(nb::none());
+                    out = std::move(list);
+                    break;
+                }
+            }
+            columns[attributes[a].c_str()] = out;
+            valid[attributes[a].c_str()] = to_numpy<uint8_t, bool>(std::move(column.valid));
+        }
+        nb::dict res;
+        res["found"] = to_numpy<uint8_t, bool>(std::move(result.found));
+        res["columns"] = columns;
+        res["valid"] = valid;
+        return res;
+    }
+
+    // ("==", attr, v), ("!=", attr, v), ("<", attr, v), (">", attr, v), ("in", attr, [v, ...]),
+    // ("contains", attr, s), ("has", attr), ("and", f, ...), ("or", f, ...)
+    SmallCache::Filter filter_from_python(nb::handle obj)
+    {
+        using Op = SmallCache::Filter::Op;
+        static const absl::flat_hash_map<std::string, Op> ops = {
+            {"==", Op::Eq}, {"!=", Op::Ne}, {"<", Op::Lt}, {">", Op::Gt}, {"in", Op::In},
+            {"contains", Op::Contains}, {"has", Op::Has}, {"and", Op::And}, {"or", Op::Or},
+        };
+        if (!nb::isinstance<nb::tuple>(obj) || nb::len(obj) == 0)
+            throw nb::type_error("filter must be a non-empty tuple such as ('==', 'attr', value)");
+        const auto parts = nb::borrow<nb::tuple>(obj);
+        const auto name = nb::cast<std::string>(parts[0]);
+        const auto op = ops.find(name);
+        if (op == ops.end())
+            throw nb::value_error(("unknown filter operator '" + name + "'").c_str());
+
+        SmallCache::Filter filter{.op = op->second};
+        if (filter.op == Op::And || filter.op == Op::Or)
+        {
+            for (size_t i = 1; i < parts.size(); ++i)
+                filter.children.push_back(filter_from_python(nb::handle(parts[i].ptr())));
+            return filter;
+        }
+        const size_t arity = filter.op == Op::Has ? 2 : 3;
+        if (parts.size() != arity)
+            throw nb::value_error(("filter '" + name + "' takes " + std::to_string(arity - 1) + " arguments").c_str());
+        filter.attribute = nb::cast<std::string>(parts[1]);
+        if (filter.op == Op::In)
+            filter.values = nb::cast<std::vector<SmallCache::pyAttrValue>>(parts[2]);
+        else if (filter.op != Op::Has)
+            filter.values.push_back(nb::cast<SmallCache::pyAttrValue>(parts[2]));
+        return filter;
+    }
+
+    // Python value -> pyAttrValue, with the common scalar types handled without the variant caster.
+    SmallCache::pyAttrValue value_from_python(nb::handle obj)
+    {
+        PyObject* o = obj.ptr();
+        if (o == Py_None)
+            return {};
+        if (PyBool_Check(o))
+            return o == Py_True;
+        if (PyFloat_Check(o) || PyLong_Check(o))
+        {
+            const double d = PyFloat_AsDouble(o);
+            if (d == -1.0 && PyErr_Occurred())
+                nb::raise_python_error();
+            return d;
+        }
+        if (PyUnicode_Check(o))
+        {
+            Py_ssize_t size = 0;
+            const char* data = PyUnicode_AsUTF8AndSize(o, &size);
+            if (!data)
+                nb::raise_python_error();
+            return SmallCache::str(data, static_cast<size_t>(size));
+        }
+        return nb::cast<SmallCache::pyAttrValue>(obj);
+    }
+
+    // Python rows -> one row-major buffer for SmallCache::add_many_flat. The values have to be
+    // converted with the GIL held, which must not wait on the cache's write lock, so they are copied
+    // out first; a single buffer keeps that to one allocation per batch rather than one per row.
+    std::vector<SmallCache::pyAttrValue> rows_from_python(nb::handle rows, size_t count, size_t width)
+    {
+        if (nb::len(rows) != count)
+            throw nb::value_error("add_many needs one row per id");
+        std::vector<SmallCache::pyAttrValue> out;
+        out.reserve(count * width);
+        for (nb::handle row : rows)
+        {
+            if (nb::len(row) != width)
+                throw nb::value_error("add_many needs one value per attribute in every row");
+            for (nb::handle value : row)
+                out.push_back(value_from_python(value));
+        }
+        return out;
+    }
+
+    // {attribute: column} -> the row-major buffer of add_many_flat. float64 arrays are read directly,
+    // NaN meaning absent.
+    std::vector<SmallCache::pyAttrValue> columns_to_rows(size_t count, const nb::dict& columns,
+                                                         std::vector<std::string>& attributes)
+    {
+        const size_t width = columns.size();
+        std::vector<SmallCache::pyAttrValue> rows(count * width);
+        size_t a = 0;
+        for (auto [name, column] : columns)
+        {
+            attributes.push_back(nb::cast<std::string>(name));
+            if (nb::ndarray<const double, nb::ndim<1>> array; nb::try_cast(column, array, false))
+            {
+                if (array.shape(0) != count)
+                    throw nb::value_error(("column '" + attributes.back() + "' has the wrong length").c_str());
+                for (size_t i = 0; i < count; ++i)
+                {
+                    if (const double d = array(i); !std::isnan(d))
+                        rows[i * width + a] = d;
+                }
+            }
+            else
+            {
+                if (nb::len(column) != count)
+                    throw nb::value_error(("column '" + attributes.back() + "' has the wrong length").c_str());
+                size_t i = 0;
+                for (nb::handle value : column)
+                    rows[i++ * width + a] = value_from_python(value);
+            }
+            ++a;
+        }
+        return rows;
+    }
+
+    nb::dict metrics_to_dict(const MetricsSnapshot& snapshot)
+    {
+        nb::dict out;
+        out["enabled"] = snapshot.enabled;
+        nb::dict counters;
+        for (const auto& [name, value] : snapshot.counters)
+            counters[name.c_str()] = value;
+        out["counters"] = counters;
+        nb::dict histograms;
+        for (const auto& [name, h] : snapshot.histograms)
+        {
+            nb::dict hist;
+            hist["count"] = h.count;
+            hist["sum"] = h.sum;
+            hist["max"] = h.max;
+            hist["p50"] = h.p50;
+            hist["p90"] = h.p90;
+            hist["p99"] = h.p99;
+            hist["buckets"] = nb::cast(h.buckets);
+            histograms[name.c_str()] = hist;
+        }
+        out["histograms"] = histograms;
+        return out;
+    }
+}
+
 NB_MODULE(_small_cache_impl, m)
 {
+    nb::enum_<ParserBackend>(m, "ParserBackend")
+        .value("glaze", ParserBackend::Glaze)
+        .value("simdjson", ParserBackend::Simdjson);
+
+    nb::class_<SmallCache::IdCursor>(m, "IdCursor")
+        .def("__iter__", [](nb::handle self) { return self; })
+        .def("__next__", [](SmallCache::IdCursor& self)
+        {
+            std::vector<std::string> ids;
+            {
+                nb::gil_scoped_release release;
+                ids = self.next_chunk();
+            }
+            if (ids.empty())
+                throw nb::stop_iteration();
+            return ids;
+        }, nb::lock_self()); // the cursor position is not shared-safe, unlike SmallCache itself
+
     nb::class_<SmallCache> cache(m, "SmallCache");
     cache
-        .def(nb::init<std::vector<std::string>>(), nb::arg("attribute_names"))
+        .def(nb::init<std::vector<std::string>, ParserBackend>(), nb::arg("attribute_names"),
+             nb::arg("parser") = SmallCache::default_parser_backend())
+        .def_static("parser_backend_available", &SmallCache::parser_backend_available, nb::arg("backend"))
+        .def_prop_ro("parser_backend", &SmallCache::parser_backend)
         .def("begin_transaction", &SmallCache::begin_transaction,
              nb::arg("estimated_number_of_items") = 0,
-             nb::arg("remove_old_items") = true)
-        .def("end_transaction", &SmallCache::end_transaction)
-        .def("add", &SmallCache::add_item, nb::arg("item_id"), nb::arg("attributes"))
-        .def("get_one", &SmallCache::get_one, nb::arg("id"), nb::arg("attributes"))
-        .def("get_many", &SmallCache::get_many, nb::arg("ids"), nb::arg("attributes"))
-        .def("get_all_ids", &SmallCache::get_all_ids)
-        .def("load_page", &SmallCache::load_page, nb::arg("json_text"));
+             nb::arg("remove_old_items") = true, nb::call_guard<nb::gil_scoped_release>())
+        .def("end_transaction", &SmallCache::end_transaction, nb::call_guard<nb::gil_scoped_release>())
+        .def("add", &SmallCache::add_item, nb::arg("item_id"), nb::arg("attributes"), nb::arg("ttl_seconds") = 0.0,
+             nb::call_guard<nb::gil_scoped_release>())
+        .def("add_many", [](SmallCache& self, const std::vector<std::string>& ids,
+                            const std::vector<std::string>& attributes, nb::handle rows)
+        {
+            auto converted = rows_from_python(rows, ids.size(), attributes.size());
+            nb::gil_scoped_release release;
+            return self.add_many_flat(ids, attributes, std::move(converted));
+        }, nb::arg("ids"), nb::arg("attributes"), nb::arg("rows"))
+        .def("add_many_columns", [](SmallCache& self, const std::vector<std::string>& ids, const nb::dict& columns)
+        {
+            std::vector<std::string> attributes;
+            auto rows = columns_to_rows(ids.size(), columns, attributes);
+            nb::gil_scoped_release release;
+            return self.add_many_flat(ids, attributes, std::move(rows));
+        }, nb::arg("ids"), nb::arg("columns"))
+        .def("set_ttl", &SmallCache::set_ttl, nb::arg("item_id"), nb::arg("ttl_seconds"), nb::call_guard<nb::gil_scoped_release>())
+        .def("patch", &SmallCache::patch_item, nb::arg("item_id"), nb::arg("attributes"), nb::call_guard<nb::gil_scoped_release>())
+        .def("patch_many", &SmallCache::patch_many, nb::arg("patches"), nb::call_guard<nb::gil_scoped_release>())
+        .def("get_one", &SmallCache::get_one, nb::arg("id"), nb::arg("attributes"), nb::call_guard<nb::gil_scoped_release>())
+        .def("get_many", &SmallCache::get_many, nb::arg("ids"), nb::arg("attributes"), nb::call_guard<nb::gil_scoped_release>())
+        .def("get_many_columnar", [](SmallCache& self, const std::vector<std::string>& ids,
+                                     const std::vector<std::string>& attributes)
+        {
+            SmallCache::ColumnarResult result;
+            {
+                nb::gil_scoped_release release;
+                result = self.get_many_columnar(ids, attributes);
+            }
+            return columnar_to_dict(attributes, std::move(result));
+        }, nb::arg("ids"), nb::arg("attributes"))
+        .def("scan", [](const SmallCache& self, nb::handle filter, const std::vector<std::string>& attributes,
+                        size_t limit, size_t threads)
+        {
+            const auto compiled = filter_from_python(filter);
+            std::vector<SmallCache::Row> rows;
+            {
+                nb::gil_scoped_release release;
+                rows = self.scan(compiled, attributes, limit, threads);
+            }
+            return rows;
+        }, nb::arg("filter"), nb::arg("attributes"), nb::arg("limit") = 0, nb::arg("threads") = 0)
+        .def("set_ordered_index", &SmallCache::set_ordered_index, nb::arg("enabled") = true, nb::call_guard<nb::gil_scoped_release>())
+        .def_prop_ro("has_ordered_index", [](const SmallCache& self)
+        {
+            nb::gil_scoped_release release; // takes the read lock, which a writer may hold for a while
+            return self.has_ordered_index();
+        })
+        .def("prefix_scan", &SmallCache::prefix_scan, nb::arg("prefix"), nb::arg("attributes"),
+             nb::arg("limit") = 0, nb::call_guard<nb::gil_scoped_release>())
+        .def("range_scan", &SmallCache::range_scan, nb::arg("lo"), nb::arg("hi").none(), nb::arg("attributes"),
+             nb::arg("limit") = 0, nb::call_guard<nb::gil_scoped_release>())
+        .def("publish_shared", &SmallCache::publish_shared, nb::arg("name"),
+             nb::call_guard<nb::gil_scoped_release>())
+        .def_static("remove_shared", &SmallCache::remove_shared, nb::arg("name"))
+        .def("aggregate", [](const SmallCache& self, const std::vector<std::string>& group_by,
+                             const std::vector<std::string>& metrics, size_t threads)
+        {
+            using Kind = SmallCache::Metric::Kind;
+            std::vector<SmallCache::Metric> parsed;
+            for (const auto& spec : metrics)
+                parsed.push_back(SmallCache::Metric::parse(spec));
+            std::vector<SmallCache::AggregateRow> rows;
+            {
+                nb::gil_scoped_release release;
+                rows = self.aggregate(group_by, parsed, threads);
+            }
+
+            nb::list out;
+            for (auto& row : rows)
+            {
+                nb::dict group;
+                for (size_t k = 0; k < group_by.size(); ++k)
+                    group[group_by[k].c_str()] = nb::cast(std::move(row.key[k]));
+                for (size_t m = 0; m < metrics.size(); ++m)
+                {
+                    const auto& value = row.values[m];
+                    const bool integral = parsed[m].kind == Kind::Count || parsed[m].kind == Kind::CountDistinct;
+                    if (!value)
+                        group[metrics[m].c_str()] = nb::none();
+                    else if (integral)
+                        group[metrics[m].c_str()] = static_cast<uint64_t>(*value);
+                    else
+                        group[metrics[m].c_str()] = *value;
+                }
+                out.append(group);
+            }
+            return out;
+        }, nb::arg("group_by"), nb::arg("metrics"), nb::arg("threads") = 0)
+        .def("enable_transaction_log", &SmallCache::enable_transaction_log, nb::arg("path") = "",
+             nb::arg("max_buffered") = size_t{64} << 20, nb::call_guard<nb::gil_scoped_release>())
+        .def("disable_transaction_log", &SmallCache::disable_transaction_log,
+             nb::call_guard<nb::gil_scoped_release>())
+        .def("take_transaction_log", [](SmallCache& self)
+        {
+            std::string log;
+            {
+                nb::gil_scoped_release release;
+                log = self.take_transaction_log();
+            }
+            return nb::bytes(log.data(), log.size());
+        })
+        .def("apply_log", [](SmallCache& self, nb::handle log)
+        {
+            // a str or os.PathLike names a file or pipe; anything else is the log itself
+            if (PyUnicode_Check(log.ptr()) || nb::hasattr(log, "__fspath__"))
+            {
+                const auto path = nb::cast<std::string>(nb::module_::import_("os").attr("fsdecode")(log));
+                nb::gil_scoped_release release;
+                return self.apply_log_file(path);
+            }
+            const TextBuffer buffer(log);
+            nb::gil_scoped_release release;
+            return self.apply_log(buffer.view());
+        }, nb::arg("log"))
+        .def("add_attribute", &SmallCache::add_attribute, nb::arg("name"), nb::call_guard<nb::gil_scoped_release>())
+        .def("drop_attribute", &SmallCache::drop_attribute, nb::arg("name"), nb::call_guard<nb::gil_scoped_release>())
+        .def("compact_attributes", &SmallCache::compact_attributes, nb::call_guard<nb::gil_scoped_release>())
+        .def("get_all_ids", &SmallCache::get_all_ids, nb::call_guard<nb::gil_scoped_release>())
+        .def("iter_ids", &SmallCache::id_cursor, nb::arg("chunk_size") = 65536, nb::keep_alive<0, 1>(),
+             nb::call_guard<nb::gil_scoped_release>())
+        .def("ids_count", &SmallCache::ids_count, nb::call_guard<nb::gil_scoped_release>())
+        .def("load_page", [](SmallCache& self, nb::handle json_text)
+             {
+                 const TextBuffer text(json_text);
+                 nb::gil_scoped_release release;
+                 return self.load_page(text.view());
+             }, nb::arg("json_text"))
+        .def("load_pages", [](SmallCache& self, nb::handle json_stream)
+             {
+                 const TextBuffer text(json_stream);
+                 nb::gil_scoped_release release;
+                 return self.load_pages(text.view());
+             }, nb::arg("json_stream"))
+        .def("load_file", &SmallCache::load_file, nb::arg("path"), nb::call_guard<nb::gil_scoped_release>())
+        .def("load_directory", &SmallCache::load_directory, nb::arg("path"), nb::arg("pattern") = "*.json",
+             nb::arg("threads") = 1, nb::call_guard<nb::gil_scoped_release>())
+        .def("set_memory_budget", &SmallCache::set_memory_budget, nb::arg("max_bytes"), nb::call_guard<nb::gil_scoped_release>())
+        .def("sweep_expired", &SmallCache::sweep_expired,
+             nb::arg("max_items") = std::numeric_limits<size_t>::max(), nb::call_guard<nb::gil_scoped_release>())
+        .def("eviction_stats", [](const SmallCache& self)
+        {
+            SmallCache::EvictionStats stats;
+            {
+                nb::gil_scoped_release release;
+                stats = self.eviction_stats();
+            }
+            nb::dict out;
+            out["memory_budget"] = stats.memory_budget;
+            out["tracked_bytes"] = stats.tracked_bytes;
+            out["evicted"] = stats.evicted;
+            out["expired"] = stats.expired;
+            out["queued_deadlines"] = stats.queued_deadlines;
+            return out;
+        })
+        .def("metrics", [](const SmallCache& self)
+        {
+            MetricsSnapshot snapshot;
+            {
+                nb::gil_scoped_release release;
+                snapshot = self.metrics();
+            }
+            return metrics_to_dict(snapshot);
+        })
+        .def("reset_metrics", &SmallCache::reset_metrics, nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<SharedCacheReader>(m, "SharedCacheReader")
+        .def(nb::init<std::string>(), nb::arg("name"))
+        .def("refresh", &SharedCacheReader::refresh, nb::call_guard<nb::gil_scoped_release>())
+        .def_prop_ro("generation", [](const SharedCacheReader& self)
+        {
+            nb::gil_scoped_release release;
+            return self.generation();
+        })
+        .def("__len__", &SharedCacheReader::size, nb::call_guard<nb::gil_scoped_release>())
+        .def("attributes", &SharedCacheReader::attributes, nb::call_guard<nb::gil_scoped_release>())
+        .def("get_one", &SharedCacheReader::get_one, nb::arg("id"), nb::arg("attributes"),
+             nb::call_guard<nb::gil_scoped_release>())
+        .def("get_many", &SharedCacheReader::get_many, nb::arg("ids"), nb::arg("attributes"),
+             nb::call_guard<nb::gil_scoped_release>());
 }
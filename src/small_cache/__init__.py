@@ -1 +1 @@
-from ._small_cache_impl import SmallCache, __doc__
+from ._small_cache_impl import SmallCache, ParserBackend, SharedCacheReader, __doc__
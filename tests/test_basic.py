@@ -1,5 +1,210 @@
+import threading
+import pytest
 import small_cache as m
 
 def test_create():
     m.SmallCache(["test1","2"])
 
+
+def test_parser_backend():
+    assert m.SmallCache.parser_backend_available(m.ParserBackend.glaze)
+    c = m.SmallCache(["a"], parser=m.ParserBackend.glaze)
+    assert c.parser_backend == m.ParserBackend.glaze
+
+def test_metrics():
+    c = m.SmallCache(["a"])
+    c.get_one("missing", ["a"])
+    metrics = c.metrics()
+    if metrics["enabled"]:
+        assert metrics["counters"]["get_one_misses"] == 1
+        assert metrics["histograms"]["get_one_ns"]["count"] == 1
+
+def test_load_page_buffers():
+    page = b'{"result": {"count": 1, "pagination": {"page": 1, "pages": 1}, "data": [{"id": "1", "attributes": [{"id": "a", "value": 1}]}]}}'
+    c = m.SmallCache(["a"])
+    c.begin_transaction()
+    assert c.load_page(page) == 1
+    assert c.load_page(memoryview(bytearray(page))) == 1
+    assert c.load_page(page.decode()) == 1
+    assert c.load_pages(page + b"\n" + page) == 2
+    c.end_transaction()
+    assert c.get_one("1", ["a"]) == [1.0]
+
+def test_get_many_columnar():
+    c = m.SmallCache(["num", "name"])
+    c.begin_transaction()
+    c.add("1", {"num": 1.0, "name": "x"})
+    c.add("2", {"name": "x"})
+    c.end_transaction()
+    res = c.get_many_columnar(["1", "2", "3"], ["num", "name"])
+    assert res["found"].tolist() == [True, True, False]
+    assert res["columns"]["num"][0] == 1.0
+    assert res["valid"]["num"].tolist() == [True, False, False]
+    names = res["columns"]["name"]
+    assert names[:2] == ["x", "x"] and names[0] is names[1] and names[2] is None
+
+def test_scan():
+    c = m.SmallCache(["color", "price"])
+    c.begin_transaction()
+    c.add("1", {"color": "red", "price": 5.0})
+    c.add("2", {"color": "blue", "price": 50.0})
+    c.add("3", {"price": 500.0})
+    c.end_transaction()
+    assert c.scan(("==", "color", "red"), ["price"]) == [("1", [5.0])]
+    assert sorted(i for i, _ in c.scan(("!=", "color", "red"), [])) == ["2", "3"]
+    assert len(c.scan(("or", ("in", "color", ["blue"]), (">", "price", 100.0)), [])) == 2
+    assert len(c.scan(("has", "price"), [], limit=1)) == 1
+
+def test_aggregate():
+    c = m.SmallCache(["color", "price"])
+    c.begin_transaction()
+    c.add("1", {"color": "red", "price": 5.0})
+    c.add("2", {"color": "red", "price": 7.0})
+    c.add("3", {"color": "blue"})
+    c.end_transaction()
+    rows = sorted(c.aggregate(["color"], ["count", "sum(price)", "max(price)"]), key=lambda r: r["color"])
+    assert rows == [
+        {"color": "blue", "count": 1, "sum(price)": 0.0, "max(price)": None},
+        {"color": "red", "count": 2, "sum(price)": 12.0, "max(price)": 7.0},
+    ]
+
+def test_iter_ids():
+    c = m.SmallCache(["a"])
+    c.begin_transaction()
+    for i in range(10):
+        c.add(str(i), {"a": 1.0})
+    c.end_transaction()
+    assert c.ids_count() == 10
+    chunks = list(c.iter_ids(chunk_size=4))
+    assert [len(chunk) for chunk in chunks] == [4, 4, 2]
+    assert sorted(sum(chunks, [])) == sorted(c.get_all_ids())
+
+def test_iter_ids_invalidated_by_reserve():
+    c = m.SmallCache(["a"])
+    c.begin_transaction()
+    for i in range(1000):
+        c.add(str(i), {"a": 1.0})
+    c.end_transaction()
+    cursor = c.iter_ids(chunk_size=10)
+    next(cursor)
+    # no estimate, or one the map already holds, leaves the table alone
+    c.begin_transaction()
+    c.end_transaction()
+    c.begin_transaction(c.ids_count())
+    c.end_transaction()
+    next(cursor)
+    # a larger estimate rebuilds the table, even when the bucket count does not change
+    c.begin_transaction(c.ids_count() + 1)
+    with pytest.raises(RuntimeError):
+        next(cursor)
+    c.end_transaction()
+
+def test_schema_evolution():
+    c = m.SmallCache(["a"])
+    c.begin_transaction()
+    c.add("1", {"a": 1.0, "b": 2.0})
+    c.end_transaction()
+    assert c.add_attribute("b")
+    assert c.get_one("1", ["a", "b"]) == [1.0, None]
+    c.patch("1", {"b": 2.0})
+    assert c.drop_attribute("a")
+    assert c.get_one("1", ["a", "b"]) == [None, 2.0]
+    assert c.compact_attributes() == 1
+
+def test_ordered_index():
+    c = m.SmallCache(["a"])
+    c.set_ordered_index()
+    c.begin_transaction()
+    for tenant in ("t1", "t2"):
+        for sku in range(3):
+            c.add(f"{tenant}:cat:{sku}", {"a": float(sku)})
+    c.end_transaction()
+    assert [i for i, _ in c.prefix_scan("t2:", ["a"])] == ["t2:cat:0", "t2:cat:1", "t2:cat:2"]
+    assert c.range_scan("t1:cat:1", "t2", ["a"]) == [("t1:cat:1", [1.0]), ("t1:cat:2", [2.0])]
+    assert len(c.range_scan("t1:cat:2", None, [], limit=2)) == 2
+
+def test_shared_segment():
+    import os
+    name = f"small_cache_pytest_{os.getpid()}"
+    c = m.SmallCache(["a", "b"])
+    c.begin_transaction()
+    c.add("1", {"a": 1.0, "b": ["x", "y"]})
+    c.end_transaction()
+    try:
+        assert c.publish_shared(name) == 1
+        reader = m.SharedCacheReader(name)
+        assert len(reader) == 1
+        assert reader.get_one("1", ["b", "a"]) == [["x", "y"], 1.0]
+        assert reader.get_many(["1", "2"], ["a"]) == [[1.0], []]
+        c.begin_transaction()
+        c.add("2", {"a": 2.0})
+        c.end_transaction()
+        assert c.publish_shared(name) == 2
+        assert reader.get_one("2", ["a"]) == [2.0] and reader.generation == 2
+    finally:
+        m.SmallCache.remove_shared(name)
+
+def test_add_many():
+    c = m.SmallCache(["num", "name", "tags"])
+    c.begin_transaction()
+    assert c.add_many(["1", "2"], ["num", "name", "other"], [(1, "x", 0), [None, "y", None]]) == 2
+    assert c.add_many_columns(["3", "4"], {"num": [3.0, None], "tags": [["a"], None]}) == 2
+    with pytest.raises(ValueError):
+        c.add_many(["5", "6"], ["num"], [(5.0,), (6.0, 7.0)])
+    c.end_transaction()
+    assert c.get_many(["1", "2", "3", "4"], ["num", "name", "tags"]) == [
+        [1.0, "x", None], [None, "y", None], [3.0, None, ["a"]], [None, None, None]]
+    assert c.get_one("5", ["num"]) == []
+
+def test_concurrent_reads():
+    c = m.SmallCache(["a", "b"])
+    c.begin_transaction()
+    c.add_many([str(i) for i in range(100)], ["a", "b"], [(0.0, 0.0)] * 100)
+    c.end_transaction()
+    torn = []
+
+    def read():
+        for _ in range(200):
+            torn.extend(row for row in c.get_many([str(i) for i in range(100)], ["a", "b"]) if row[0] != row[1])
+
+    readers = [threading.Thread(target=read) for _ in range(4)]
+    for t in readers:
+        t.start()
+    for v in range(1, 20):
+        c.begin_transaction()
+        c.add_many([str(i) for i in range(100)], ["a", "b"], [(float(v), float(v))] * 100)
+        c.end_transaction()
+    for t in readers:
+        t.join()
+    assert not torn
+    assert c.get_one("5", ["a"]) == [19.0]
+
+def test_transaction_log(tmp_path):
+    source = m.SmallCache(["a", "b"])
+    source.enable_transaction_log()
+    source.begin_transaction()
+    source.add("1", {"a": 1.0, "b": ["x", "y"]})
+    source.add("2", {"a": 2.0, "b": "z"})
+    source.end_transaction()
+    source.patch("1", {"a": 5.0})
+    log = source.take_transaction_log()
+    assert isinstance(log, bytes)
+
+    replica = m.SmallCache(["b", "a"])
+    assert replica.apply_log(log) == 2
+    assert replica.get_many(["1", "2"], ["a", "b"]) == [[5.0, ["x", "y"]], [2.0, "z"]]
+
+    path = tmp_path / "cache.log"
+    path.write_bytes(log)
+    other = m.SmallCache(["a"])
+    assert other.apply_log(path) == 2
+    assert other.get_one("1", ["a"]) == [5.0]
+
+    bounded = m.SmallCache(["a"])
+    bounded.enable_transaction_log(max_buffered=0)
+    bounded.begin_transaction()
+    bounded.add("1", {"a": 1.0})
+    bounded.end_transaction()
+    with pytest.raises(RuntimeError):
+        bounded.take_transaction_log()
+    assert bounded.take_transaction_log() == b""